@@ -48,6 +48,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/kernel.h>
 #include <sys/module.h>
 #include <sys/kthread.h>
+#include <sys/smp.h>
 #include <machine/bus.h>
 #include <machine/resource.h>
 #include <sys/bus.h>
@@ -81,6 +82,9 @@ SYSCTL_INT(_debug, OID_AUTO, ndis, CTLFLAG_RW, &ndis_debug,
 static void	ndis_create_sysctls(struct ndis_softc *);
 static void	ndis_flush_sysctls(struct ndis_softc *);
 static void	ndis_free_bufs(struct mdl *);
+static void	ndis_reset_txpacket(struct ndis_packet *, uint32_t);
+static void	ndis_txbounce_cb(void *, bus_dma_segment_t *, int, int);
+static int	ndis_init_txbounce(struct ndis_softc *);
 static void	NdisMIndicateStatus(struct ndis_miniport_block *, int32_t,
 		    void *, uint32_t);
 static void	NdisMIndicateStatusComplete(struct ndis_miniport_block *);
@@ -338,26 +342,61 @@ ndis_get_routine_address(struct image_patch_table *functbl, char *name)
 static void
 ndis_return_packet_nic(struct device_object *dobj,
     struct ndis_miniport_block *block)
+{
+
+	KASSERT(block != NULL, ("no block"));
+	ndis_return_flush(block);
+}
+
+/*
+ * Give all packets sitting on the per-CPU return lists back to the
+ * miniport. This is called at the end of each interrupt DPC, from the
+ * return work item when a list grows past NDIS_RETURN_BATCH, and
+ * from the periodic tick as a safety net. Each list is taken with a
+ * single atomic swap, so concurrent flushes never see the same packet.
+ * A serialized miniport expects MiniportReturnPacket() to be called
+ * with its lock held, like all of its other handlers, so take it here
+ * unless the caller (the interrupt DPC) already has.
+ */
+void
+ndis_return_flush(struct ndis_miniport_block *block)
+{
+	uint8_t irql = 0;
+
+	if (NDIS_SERIALIZED(block))
+		KeAcquireSpinLock(&block->lock, &irql);
+	ndis_return_flush_locked(block);
+	if (NDIS_SERIALIZED(block))
+		KeReleaseSpinLock(&block->lock, irql);
+}
+
+void
+ndis_return_flush_locked(struct ndis_miniport_block *block)
 {
 	struct ndis_miniport_characteristics *ch;
+	struct ndis_returnq *rq;
 	struct ndis_packet *p;
-	uint8_t irql;
-	struct list_entry *l;
+	struct list_entry *l, *next;
+	int i;
 
-	KASSERT(block != NULL, ("no block"));
 	KASSERT(block->miniport_adapter_ctx != NULL, ("no adapter"));
-	ch = IoGetDriverObjectExtension(dobj->drvobj, (void *)1);
+	ch = IoGetDriverObjectExtension(block->deviceobj->drvobj, (void *)1);
 	KASSERT(ch->return_packet_func != NULL, ("no return_packet"));
-	KeAcquireSpinLock(&block->returnlock, &irql);
-	while (!IsListEmpty(&block->returnlist)) {
-		l = RemoveHeadList(&block->returnlist);
-		p = CONTAINING_RECORD(l, struct ndis_packet, list);
-		InitializeListHead(&p->list);
-		KeReleaseSpinLock(&block->returnlock, irql);
-		MSCALL2(ch->return_packet_func, block->miniport_adapter_ctx, p);
-		KeAcquireSpinLock(&block->returnlock, &irql);
+	CPU_FOREACH(i) {
+		rq = &block->returnq[i];
+		if (rq->head == NULL)
+			continue;
+		l = (struct list_entry *)atomic_readandclear_ptr(
+		    (volatile uintptr_t *)&rq->head);
+		atomic_readandclear_int(&rq->cnt);
+		for (; l != NULL; l = next) {
+			next = l->nle_flink;
+			p = CONTAINING_RECORD(l, struct ndis_packet, list);
+			InitializeListHead(&p->list);
+			MSCALL2(ch->return_packet_func,
+			    block->miniport_adapter_ctx, p);
+		}
 	}
-	KeReleaseSpinLock(&block->returnlock, irql);
 }
 
 void
@@ -365,21 +404,44 @@ ndis_return_packet(struct mbuf *m, void *buf, void *arg)
 {
 	struct ndis_packet *p = arg;
 	struct ndis_miniport_block *block;
+	struct ndis_returnq *rq;
+	struct ndis_softc *sc;
+	struct list_entry *old;
+	u_int cnt;
 
-	p->refcnt--;
-	if (p->refcnt)
+	/*
+	 * Loaned mbufs may be freed from any context, possibly on
+	 * several CPUs at once, so the reference count must be atomic.
+	 */
+	if (atomic_fetchadd_int(&p->refcnt, -1) != 1)
 		return;
 
-	block = ((struct ndis_softc *)p->softc)->ndis_block;
-	KeAcquireSpinLockAtDpcLevel(&block->returnlock);
-	InitializeListHead(&p->list);
-	InsertHeadList(&block->returnlist, &p->list);
-	KeReleaseSpinLockFromDpcLevel(&block->returnlock);
+	sc = p->softc;
+	block = sc->ndis_block;
 
-	IoQueueWorkItem(block->returnitem,
-	    (io_workitem_func)kernndis_functbl[7].wrap, CRITICAL, block);
+	critical_enter();
+	rq = &block->returnq[curcpu];
+	do {
+		old = rq->head;
+		p->list.nle_flink = old;
+	} while (!atomic_cmpset_ptr((volatile uintptr_t *)&rq->head,
+	    (uintptr_t)old, (uintptr_t)&p->list));
+	cnt = atomic_fetchadd_int(&rq->cnt, 1) + 1;
+	critical_exit();
 
-	return;
+	/*
+	 * Normally the interrupt DPC picks up returned packets. Kick
+	 * the work item only if this CPU has a full batch pending, or
+	 * if there is no interrupt to rely on (e.g. USB devices).
+	 */
+	if (cnt >= NDIS_RETURN_BATCH ||
+	    (old == NULL && block->interrupt == NULL))
+		IoQueueWorkItem(block->returnitem,
+		    (io_workitem_func)kernndis_functbl[7].wrap, CRITICAL,
+		    block);
+
+	/* Last, since ndis_detach() may free sc once this drops to 0. */
+	atomic_subtract_rel_int(&sc->ndis_rxloans, 1);
 }
 
 static void
@@ -418,7 +480,6 @@ ndis_convert_res(struct ndis_softc *sc)
 
 	rl->version = 1;
 	rl->revision = 1;
-	rl->count = sc->ndis_rescnt;
 	prd = rl->partial_descs;
 
 	brl = BUS_GET_RESOURCE_LIST(sc->ndis_dev, sc->ndis_dev);
@@ -442,14 +503,25 @@ ndis_convert_res(struct ndis_softc *sc)
 				prd->u.mem.len = brle->count;
 				break;
 			case SYS_RES_IRQ:
+				/*
+				 * Only report the interrupt we hook, not
+				 * the INTx line when MSI is in use.
+				 */
+				if (brle->rid != sc->ndis_irq_rid)
+					continue;
 				prd->type = CmResourceTypeInterrupt;
-				prd->flags = 0;
 				/*
-				 * Always mark interrupt resources as
-				 * shared, since in our implementation,
-				 * they will be.
+				 * INTx lines are level triggered and
+				 * possibly shared, messages are neither.
 				 */
+				prd->flags = 0;
 				prd->sharedisp = CM_RESOURCE_SHARE_SHARED;
+				if (sc->ndis_msi) {
+					prd->flags =
+					    CM_RESOURCE_INTERRUPT_LATCHED;
+					prd->sharedisp =
+					    CM_RESOURCE_SHARE_DEVICE_EXCLUSIVE;
+				}
 				prd->u.intr.level = brle->start;
 				prd->u.intr.vector = brle->start;
 				prd->u.intr.affinity = 0;
@@ -461,6 +533,7 @@ ndis_convert_res(struct ndis_softc *sc)
 		}
 	}
 
+	rl->count = prd - rl->partial_descs;
 	sc->ndis_block->rlist = rl;
 
 	return (0);
@@ -491,7 +564,14 @@ ndis_ptom(struct mbuf **m0, struct ndis_packet *p)
 
 	KASSERT(p != NULL, ("no packet"));
 	priv = &p->private;
-	p->refcnt = 0;
+	*m0 = NULL;
+
+	/*
+	 * Hold a reference of our own while the chain is built so
+	 * that freeing a partial chain on failure doesn't hand the
+	 * packet back to the miniport behind the caller's back.
+	 */
+	p->refcnt = 1;
 
 	for (buf = priv->head; buf != NULL; buf = buf->next) {
 		if (buf == priv->head)
@@ -501,6 +581,7 @@ ndis_ptom(struct mbuf **m0, struct ndis_packet *p)
 		if (m == NULL) {
 			m_freem(*m0);
 			*m0 = NULL;
+			p->refcnt = 0;
 			return (ENOBUFS);
 		}
 		m->m_len = MmGetMdlByteCount(buf);
@@ -535,6 +616,58 @@ ndis_ptom(struct mbuf **m0, struct ndis_packet *p)
 		m->m_len -= diff;
 	}
 	(*m0)->m_pkthdr.len = totlen;
+	p->refcnt--;
+
+	return (0);
+}
+
+/*
+ * Copy an NDIS packet into a single mbuf, cluster or jumbo cluster,
+ * whichever is the smallest that fits. Unlike ndis_ptom(), the
+ * resulting mbuf does not reference the driver's buffers, so the
+ * packet can be given back to the miniport as soon as the receive
+ * indication completes. Packets longer than 'maxlen' are left alone
+ * and EFBIG is returned, in which case the caller may loan the
+ * packet with ndis_ptom() instead.
+ */
+int
+ndis_ptom_copy(struct mbuf **m0, struct ndis_packet *p, uint32_t maxlen)
+{
+	struct mbuf *m;
+	struct mdl *buf;
+	uint32_t totlen = 0, len;
+	struct ifnet *ifp;
+	struct ether_header *eh;
+
+	KASSERT(p != NULL, ("no packet"));
+	*m0 = NULL;
+
+	for (buf = p->private.head; buf != NULL; buf = buf->next)
+		totlen += MmGetMdlByteCount(buf);
+	if (totlen == 0 || totlen > maxlen ||
+	    totlen + ETHER_ALIGN > MJUM16BYTES)
+		return (EFBIG);
+
+	m = m_get2(totlen + ETHER_ALIGN, M_NOWAIT, MT_DATA, M_PKTHDR);
+	if (m == NULL)
+		return (ENOBUFS);
+
+	/* Align the IP header while we're at it. */
+	m->m_data += ETHER_ALIGN;
+	for (buf = p->private.head; buf != NULL; buf = buf->next) {
+		len = MmGetMdlByteCount(buf);
+		bcopy(MmGetMdlVirtualAddress(buf), mtod(m, char *) + m->m_len,
+		    len);
+		m->m_len += len;
+	}
+
+	/* Same frame size clamp as in ndis_ptom(). */
+	eh = mtod(m, struct ether_header *);
+	ifp = ((struct ndis_softc *)p->softc)->ndis_ifp;
+	if (m->m_len > ETHER_MAX_FRAME(ifp, eh->ether_type, FALSE))
+		m->m_len = ETHER_MAX_FRAME(ifp, eh->ether_type, FALSE);
+	m->m_pkthdr.len = m->m_len;
+	*m0 = m;
 
 	return (0);
 }
@@ -587,12 +720,119 @@ ndis_mtop(struct mbuf *m0, struct ndis_packet **p)
 	return (0);
 }
 
+static void
+ndis_reset_txpacket(struct ndis_packet *p, uint32_t len)
+{
+	struct ndis_packet_private *priv = &p->private;
+	void *pool;
+
+	pool = priv->pool;
+	bzero(priv, sizeof(*priv));
+	bzero(&p->oob, sizeof(p->oob));
+	bzero(&p->ext, sizeof(p->ext));
+	priv->pool = pool;
+	priv->ndis_packet_oob_offset = offsetof(struct ndis_packet, oob);
+	priv->ndis_packet_flags = NDIS_PACKET_ALLOCATED_BY_NDIS;
+	priv->valid_counts = FALSE;
+	priv->total_length = len;
+}
+
+/*
+ * Variant of ndis_mtop() for transmit packets which are recycled
+ * rather than allocated for each frame. The packet is reset to the
+ * state NdisAllocatePacket() would leave it in (except for the parts
+ * the miniport owns or that we overwrite anyway), and the mbuf chain
+ * is described using the caller's embedded MDLs. Mbufs beyond 'mdlcnt',
+ * or spanning more pages than an embedded MDL can describe, get a
+ * regular MDL from IoAllocateMdl() instead.
+ */
+int
+ndis_mtop_reuse(struct mbuf *m0, struct ndis_packet *p,
+    struct ndis_txmdl *mdls, int mdlcnt)
+{
+	struct mbuf *m;
+	struct mdl *buf = NULL, *prev = NULL;
+	struct ndis_packet_private *priv;
+	int i = 0;
+
+	KASSERT(p != NULL, ("no packet"));
+	ndis_reset_txpacket(p, m0->m_pkthdr.len);
+	priv = &p->private;
+
+	for (m = m0; m != NULL; m = m->m_next) {
+		if (m->m_len == 0)
+			continue;
+		if (i < mdlcnt &&
+		    SPAN_PAGES(m->m_data, m->m_len) <= NDIS_TXMDL_PAGES) {
+			buf = &mdls[i++].tm_mdl;
+			MmInitializeMdl(buf, m->m_data, m->m_len);
+		} else {
+			buf = IoAllocateMdl(m->m_data, m->m_len, FALSE, FALSE,
+			    NULL);
+			if (buf == NULL) {
+				ndis_mtop_release(p, mdls, mdlcnt);
+				return (ENOMEM);
+			}
+		}
+		MmBuildMdlForNonPagedPool(buf);
+
+		if (priv->head == NULL)
+			priv->head = buf;
+		else
+			prev->next = buf;
+		prev = buf;
+	}
+
+	priv->tail = buf;
+
+	return (0);
+}
+
+/*
+ * Undo ndis_mtop_reuse(): free any MDLs that didn't come from the
+ * embedded array and detach the chain from the packet, which stays
+ * with the caller.
+ */
+void
+ndis_mtop_release(struct ndis_packet *p, struct ndis_txmdl *mdls, int mdlcnt)
+{
+	struct mdl *buf, *next;
+
+	for (buf = p->private.head; buf != NULL; buf = next) {
+		next = buf->next;
+		if ((void *)buf < (void *)mdls ||
+		    (void *)buf >= (void *)(mdls + mdlcnt))
+			IoFreeMdl(buf);
+	}
+	p->private.head = p->private.tail = NULL;
+}
+
+/*
+ * Describe a frame that was copied into a single contiguous buffer
+ * with the first embedded MDL. The buffer must not cross more than
+ * NDIS_TXMDL_PAGES pages.
+ */
+void
+ndis_buftop_reuse(struct ndis_packet *p, void *va, uint32_t len,
+    struct ndis_txmdl *mdls)
+{
+	struct mdl *buf = &mdls[0].tm_mdl;
+
+	KASSERT(p != NULL, ("no packet"));
+	KASSERT(SPAN_PAGES(va, len) <= NDIS_TXMDL_PAGES, ("buffer too big"));
+	ndis_reset_txpacket(p, len);
+	MmInitializeMdl(buf, va, len);
+	MmBuildMdlForNonPagedPool(buf);
+	p->private.head = p->private.tail = buf;
+}
+
 static int
 ndis_request_info(uint32_t req, struct ndis_softc *sc, uint32_t oid,
     void *buf, uint32_t buflen, uint32_t *written, uint32_t *needed)
 {
 	int64_t duetime;
 	int32_t rval, w = 0, n = 0;
+	uint8_t irql;
 
 	if (!written)
 		written = &w;
@@ -603,44 +843,61 @@ ndis_request_info(uint32_t req, struct ndis_softc *sc, uint32_t oid,
 	KASSERT(sc->ndis_block->miniport_adapter_ctx != NULL, ("no adapter"));
 	KASSERT(sc->ndis_chars->query_info_func != NULL, ("no query_info"));
 	KASSERT(sc->ndis_chars->set_info_func != NULL, ("no set_info"));
+	if (req != NDIS_REQUEST_QUERY_INFORMATION &&
+	    req != NDIS_REQUEST_SET_INFORMATION)
+		return (NDIS_STATUS_NOT_SUPPORTED);
 	/*
 	 * According to the NDIS spec, MiniportQueryInformation()
 	 * and MiniportSetInformation() requests are handled serially:
 	 * once one request has been issued, we must wait for it to
 	 * finish before allowing another request to proceed.
+	 * A pended request may take seconds to complete, so that
+	 * ordering is kept by ndis_reqbusy rather than the miniport
+	 * spinlock, which is only held, at DISPATCH_LEVEL, around
+	 * the call itself.
 	 */
+	NDIS_LOCK(sc);
+	while (sc->ndis_reqbusy)
+		mtx_sleep(&sc->ndis_reqbusy, &sc->ndis_mtx, 0, "ndisreq", 0);
+	sc->ndis_reqbusy = 1;
+	NDIS_UNLOCK(sc);
+
 	if (req == NDIS_REQUEST_QUERY_INFORMATION) {
-		KeAcquireSpinLockAtDpcLevel(&sc->ndis_block->lock);
+		KeAcquireSpinLock(&sc->ndis_block->lock, &irql);
 		rval = MSCALL6(sc->ndis_chars->query_info_func,
 		    sc->ndis_block->miniport_adapter_ctx,
 		    oid, buf, buflen, written, needed);
+		KeReleaseSpinLock(&sc->ndis_block->lock, irql);
 		if (rval == NDIS_STATUS_PENDING) {
 			duetime = (5 * 1000000) * -10;
 			KeWaitForSingleObject(&sc->ndis_block->getevent,
 			    0, 0, FALSE, &duetime);
 			rval = sc->ndis_block->getstat;
 		}
-		KeReleaseSpinLockFromDpcLevel(&sc->ndis_block->lock);
 		TRACE(NDBG_GET, "req %u sc %p oid %08X buf %p buflen %u "
 		    "written %u needed %u rval %08X\n",
 		    req, sc, oid, buf, buflen, *written, *needed, rval);
-	} else if (req == NDIS_REQUEST_SET_INFORMATION) {
-		KeAcquireSpinLockAtDpcLevel(&sc->ndis_block->lock);
+	} else {
+		KeAcquireSpinLock(&sc->ndis_block->lock, &irql);
 		rval = MSCALL6(sc->ndis_chars->set_info_func,
 		    sc->ndis_block->miniport_adapter_ctx,
 		    oid, buf, buflen, written, needed);
+		KeReleaseSpinLock(&sc->ndis_block->lock, irql);
 		if (rval == NDIS_STATUS_PENDING) {
 			duetime = (5 * 1000000) * -10;
 			KeWaitForSingleObject(&sc->ndis_block->setevent,
 			    0, 0, FALSE, &duetime);
 			rval = sc->ndis_block->setstat;
 		}
-		KeReleaseSpinLockFromDpcLevel(&sc->ndis_block->lock);
 		TRACE(NDBG_SET, "req %u sc %p oid %08X buf %p buflen %u "
 		    "written %u needed %u rval %08X\n",
 		    req, sc, oid, buf, buflen, *written, *needed, rval);
-	} else
-		return (NDIS_STATUS_NOT_SUPPORTED);
+	}
+
+	NDIS_LOCK(sc);
+	sc->ndis_reqbusy = 0;
+	wakeup_one(&sc->ndis_reqbusy);
+	NDIS_UNLOCK(sc);
 	return (rval);
 }
 
@@ -705,21 +962,32 @@ ndis_send_packets(struct ndis_softc *sc, struct ndis_packet **packets,
 		KeAcquireSpinLock(&sc->ndis_block->lock, &irql);
 	MSCALL3(sc->ndis_chars->send_packets_func,
 	    sc->ndis_block->miniport_adapter_ctx, packets, cnt);
+
+	/*
+	 * A deserialized miniport completes every packet through
+	 * NdisMSendComplete(), whatever status it leaves behind, so
+	 * there is nothing for us to do.
+	 */
+	if (!NDIS_SERIALIZED(sc->ndis_block))
+		return;
+
 	for (i = 0; i < cnt; i++) {
 		p = packets[i];
 		/*
 		 * Either the driver already handed the packet to
 		 * ndis_txeof() due to a failure, or it wants to keep
 		 * it and release it asynchronously later. Skip to the
-		 * next one.
+		 * next one. Claim the entry first, so that a completion
+		 * racing with us can't have us complete it a second time.
 		 */
-		if (p == NULL || p->oob.status == NDIS_STATUS_PENDING)
+		if (p == NULL || !atomic_cmpset_ptr(
+		    (volatile uintptr_t *)&packets[i], (uintptr_t)p, 0) ||
+		    p->oob.status == NDIS_STATUS_PENDING)
 			continue;
 		MSCALL3(sc->ndis_block->send_done_func,
 		    sc->ndis_block, p, p->oob.status);
 	}
-	if (NDIS_SERIALIZED(sc->ndis_block))
-		KeReleaseSpinLock(&sc->ndis_block->lock, irql);
+	KeReleaseSpinLock(&sc->ndis_block->lock, irql);
 }
 
 int32_t
@@ -749,6 +1017,77 @@ ndis_send_packet(struct ndis_softc *sc, struct ndis_packet *packet)
 	return (status);
 }
 
+static void
+ndis_txbounce_cb(void *arg, bus_dma_segment_t *segs, int nseg, int error)
+{
+	uint64_t *paddr = arg;
+
+	if (error || nseg != 1)
+		return;
+	*paddr = segs[0].ds_addr;
+}
+
+static void
+ndis_free_txbounce(struct ndis_softc *sc)
+{
+	struct ndis_txslot *ts;
+	int i;
+
+	for (i = 0; i < sc->ndis_maxpkts; i++) {
+		ts = &sc->ndis_txslots[i];
+		if (ts->ts_bounce == NULL)
+			continue;
+		if (ts->ts_bounce_paddr != 0)
+			bus_dmamap_unload(sc->ndis_bouncetag,
+			    ts->ts_bouncemap);
+		bus_dmamem_free(sc->ndis_bouncetag, ts->ts_bounce,
+		    ts->ts_bouncemap);
+		ts->ts_bounce = NULL;
+		ts->ts_bounce_paddr = 0;
+	}
+	bus_dma_tag_destroy(sc->ndis_bouncetag);
+	sc->ndis_bouncetag = NULL;
+}
+
+/*
+ * Allocate and load a bounce buffer per TX slot. The buffers are
+ * MCLBYTES aligned, so none of them crosses a page boundary.
+ */
+static int
+ndis_init_txbounce(struct ndis_softc *sc)
+{
+	struct ndis_txslot *ts;
+	int error, i;
+
+	error = bus_dma_tag_create(sc->ndis_parent_tag, NDIS_TXBOUNCE_SIZE,
+	    0, BUS_SPACE_MAXADDR_32BIT, BUS_SPACE_MAXADDR, NULL, NULL,
+	    NDIS_TXBOUNCE_SIZE, 1, NDIS_TXBOUNCE_SIZE, 0, NULL, NULL,
+	    &sc->ndis_bouncetag);
+	if (error)
+		return (error);
+
+	for (i = 0; i < sc->ndis_maxpkts; i++) {
+		ts = &sc->ndis_txslots[i];
+		error = bus_dmamem_alloc(sc->ndis_bouncetag, &ts->ts_bounce,
+		    BUS_DMA_NOWAIT|BUS_DMA_ZERO, &ts->ts_bouncemap);
+		if (error) {
+			ts->ts_bounce = NULL;
+			goto fail;
+		}
+		error = bus_dmamap_load(sc->ndis_bouncetag, ts->ts_bouncemap,
+		    ts->ts_bounce, NDIS_TXBOUNCE_SIZE, ndis_txbounce_cb,
+		    &ts->ts_bounce_paddr, BUS_DMA_NOWAIT);
+		if (error == 0 && ts->ts_bounce_paddr == 0)
+			error = ENOMEM;
+		if (error)
+			goto fail;
+	}
+	return (0);
+fail:
+	ndis_free_txbounce(sc);
+	return (error);
+}
+
 int
 ndis_init_dma(struct ndis_softc *sc)
 {
@@ -765,6 +1104,14 @@ ndis_init_dma(struct ndis_softc *sc)
 			return (ENODEV);
 		}
 	}
+
+	/*
+	 * The TX bounce arena is only an optimization; if it can't
+	 * be set up every frame just goes through the mapping path.
+	 */
+	if (ndis_init_txbounce(sc))
+		device_printf(sc->ndis_dev, "failed to set up TX bounce "
+		    "buffers\n");
 	return (0);
 }
 
@@ -773,11 +1120,10 @@ ndis_destroy_dma(struct ndis_softc *sc)
 {
 	int i;
 
-	for (i = 0; i < sc->ndis_maxpkts; i++) {
-		if (sc->ndis_txarray[i] != NULL)
-			ndis_free_packet(sc->ndis_txarray[i]);
+	if (sc->ndis_bouncetag != NULL)
+		ndis_free_txbounce(sc);
+	for (i = 0; i < sc->ndis_maxpkts; i++)
 		bus_dmamap_destroy(sc->ndis_ttag, sc->ndis_tmaps[i]);
-	}
 	free(sc->ndis_tmaps, M_NDIS_KERN);
 	bus_dma_tag_destroy(sc->ndis_ttag);
 }
@@ -851,7 +1197,13 @@ void
 ndis_halt_nic(struct ndis_softc *sc)
 {
 
+	/*
+	 * Receive buffers loaned to the stack will be released by the
+	 * halt handler; ndis_detach() gets them all back first.
+	 */
+	KASSERT(sc->ndis_rxloans == 0, ("receive buffers still loaned"));
 	flush_queue();
+	ndis_return_flush(sc->ndis_block);
 	KASSERT(sc->ndis_chars != NULL, ("no chars"));
 	KASSERT(sc->ndis_block != NULL, ("no block"));
 	KASSERT(sc->ndis_block->miniport_adapter_ctx != NULL, ("no adapter"));
@@ -958,12 +1310,19 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 	ndis_create_sysctls(sc);
 	if (sc->ndis_bus_type == NDIS_PCMCIABUS ||
 	    sc->ndis_bus_type == NDIS_PCIBUS) {
+		/* The vector matches what ndis_convert_res() reports. */
+		sc->ndis_intrvec =
+		    ntoskrnl_intr_vector(rman_get_start(sc->ndis_irq));
+		if (sc->ndis_intrvec == NULL)
+			return (NDIS_STATUS_RESOURCES);
 		status = bus_setup_intr(sc->ndis_dev, sc->ndis_irq,
-		    INTR_TYPE_NET|INTR_MPSAFE, NULL, ntoskrnl_intr, NULL,
-		    &sc->ndis_intrhand);
+		    INTR_TYPE_NET|INTR_MPSAFE, NULL, ntoskrnl_intr,
+		    sc->ndis_intrvec, &sc->ndis_intrhand);
 		if (status) {
 			device_printf(sc->ndis_dev, "couldn't setup"
 			    "interrupt; (%d)\n", status);
+			ntoskrnl_intr_vector_release(sc->ndis_intrvec);
+			sc->ndis_intrvec = NULL;
 			return (NDIS_STATUS_FAILURE);
 		}
 	}
@@ -982,13 +1341,19 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 	block->physdeviceobj = pdo;
 	block->nextdeviceobj = IoAttachDeviceToDeviceStack(fdo, pdo);
 	KeInitializeSpinLock(&block->lock);
-	KeInitializeSpinLock(&block->returnlock);
 	KeInitializeEvent(&block->getevent, SYNCHRONIZATION_EVENT, FALSE);
 	KeInitializeEvent(&block->setevent, SYNCHRONIZATION_EVENT, FALSE);
 	KeInitializeEvent(&block->resetevent, SYNCHRONIZATION_EVENT, FALSE);
 	InitializeListHead(&block->parmlist);
-	InitializeListHead(&block->returnlist);
 	block->returnitem = IoAllocateWorkItem(fdo);
+	block->returnq = malloc(sizeof(struct ndis_returnq) * (mp_maxid + 1),
+	    M_NDIS_KERN, M_NOWAIT|M_ZERO);
+	if (block->returnq == NULL) {
+		IoFreeWorkItem(block->returnitem);
+		IoDetachDevice(block->nextdeviceobj);
+		IoDeleteDevice(fdo);
+		return (NDIS_STATUS_RESOURCES);
+	}
 
 	/*
 	 * Stash pointers to the miniport block and miniport
@@ -1006,6 +1371,8 @@ ndis_load_driver(struct driver_object *drv, struct device_object *pdo)
 		NdisAllocatePacketPool(&status, &block->rxpool,
 		    32, PROTOCOL_RESERVED_SIZE_IN_PACKET);
 		if (status != NDIS_STATUS_SUCCESS) {
+			free(block->returnq, M_NDIS_KERN);
+			IoFreeWorkItem(block->returnitem);
 			IoDetachDevice(block->nextdeviceobj);
 			IoDeleteDevice(fdo);
 			return (status);
@@ -1037,6 +1404,10 @@ ndis_unload_driver(struct ndis_softc *sc)
 	if (sc->ndis_intrhand) /* FIXME: doesn't belong here */
 		bus_teardown_intr(sc->ndis_dev,
 		    sc->ndis_irq, sc->ndis_intrhand);
+	if (sc->ndis_intrvec != NULL) {
+		ntoskrnl_intr_vector_release(sc->ndis_intrvec);
+		sc->ndis_intrvec = NULL;
+	}
 
 	if (sc->ndis_block->rlist != NULL)
 		free(sc->ndis_block->rlist, M_NDIS_KERN);
@@ -1045,6 +1416,7 @@ ndis_unload_driver(struct ndis_softc *sc)
 	if (sc->ndis_chars->transfer_data_func != NULL)
 		NdisFreePacketPool(sc->ndis_block->rxpool);
 	IoFreeWorkItem(sc->ndis_block->returnitem);
+	free(sc->ndis_block->returnq, M_NDIS_KERN);
 	IoDetachDevice(sc->ndis_block->nextdeviceobj);
 	IoDeleteDevice(sc->ndis_block->deviceobj);
 	ndis_flush_sysctls(sc);
@@ -1470,6 +1470,8 @@ struct ndis_80211_enc_indication {
 #define	NDIS_TASK_IPSEC				0x00000001
 #define	NDIS_TASK_TCP_LARGESEND			0x00000002
 
+#define	NDIS_TASK_TCP_LARGESEND_V0		0x00000000
+
 #define	NDIS_ENCAP_UNSPEC			0x00000000
 #define	NDIS_ENCAP_NULL				0x00000001
 #define	NDIS_ENCAP_IEEE802_3			0x00000002
@@ -1661,14 +1663,39 @@ struct ndis_spin_lock {
 	uint8_t			kirql;
 };
 
+/*
+ * Windows sizes the RW lock with one 16-byte reader count per
+ * processor (MAXIMUM_PROCESSORS), so drivers hand us that much
+ * storage. CPUs past the last slot share the count in u.s.shared,
+ * whose top bit a writer sets while it drains and holds the lock.
+ */
+#ifdef __amd64__
+#define	NDIS_RW_MAXCPU		64
+#else
+#define	NDIS_RW_MAXCPU		32
+#endif
+#define	NDIS_RW_WRITER		0x80000000
+
+struct ndis_rw_refcount {
+	volatile uint32_t	count;
+	uint8_t			pad[12];
+};
+
 struct ndis_rw_lock {
 	union {
-		unsigned long	spinlock;
-		void		*ctx;
+		struct {
+			unsigned long		spinlock;
+			volatile uint32_t	shared;
+		} s;
+		uint8_t		reserved[16];
 	} u;
-	uint8_t		reserved[16];
+	struct ndis_rw_refcount	refcount[NDIS_RW_MAXCPU];
 };
 
+/* lockstate is the reader's slot, or one of these. */
+#define	NDIS_RW_STATE_SHARED	0xFFFE
+#define	NDIS_RW_STATE_WRITE	0xFFFF
+
 struct ndis_lock_state {
 	uint16_t	lockstate;
 	uint8_t		oldirql;
@@ -1881,9 +1908,23 @@ struct ndis_packet {
 	void			*softc;
 	void			*m0;
 	int			txidx;
+	int			txstage;
 	struct list_entry	list;
 };
 
+/*
+ * An MDL with room for a few pages, embedded in a transmit ring slot
+ * so that it can be re-pointed at each frame instead of being
+ * allocated with IoAllocateMdl(). The page array must immediately
+ * follow the MDL, see MDL_PAGES().
+ */
+#define	NDIS_TXMDL_PAGES	4
+
+struct ndis_txmdl {
+	struct mdl		tm_mdl;
+	vm_offset_t		tm_pages[NDIS_TXMDL_PAGES];
+};
+
 struct ndis_packet_pool {
 	union slist_header	head;
 	struct nt_kevent	event;
@@ -2157,12 +2198,22 @@ struct ndis_miniport_block {
 	struct nt_kevent		resetevent;
 	struct io_workitem		*returnitem;
 	struct ndis_packet_pool		*rxpool;
-	struct list_entry		returnlist;
-	unsigned long			returnlock;
+	struct ndis_returnq		*returnq;
 	TAILQ_ENTRY(ndis_miniport_block)	link;
 };
 TAILQ_HEAD(nd_head, ndis_miniport_block);
 
+/*
+ * Per-CPU list of received packets waiting to be given back to the
+ * miniport, linked through their 'list' field, newest first.
+ */
+struct ndis_returnq {
+	struct list_entry * volatile	head;
+	volatile u_int			cnt;
+} __aligned(CACHE_LINE_SIZE);
+
+#define	NDIS_RETURN_BATCH	16
+
 struct ndis_device_type {
 	uint32_t	vendor;
 	uint32_t	device;
@@ -2178,7 +2229,13 @@ void	ndis_libfini(void);
 int32_t	ndis_load_driver(struct driver_object *, struct device_object *);
 void	ndis_unload_driver(struct ndis_softc *);
 int	ndis_mtop(struct mbuf *, struct ndis_packet **);
+int	ndis_mtop_reuse(struct mbuf *, struct ndis_packet *,
+	    struct ndis_txmdl *, int);
+void	ndis_mtop_release(struct ndis_packet *, struct ndis_txmdl *, int);
+void	ndis_buftop_reuse(struct ndis_packet *, void *, uint32_t,
+	    struct ndis_txmdl *);
 int	ndis_ptom(struct mbuf **, struct ndis_packet *);
+int	ndis_ptom_copy(struct mbuf **, struct ndis_packet *, uint32_t);
 int	ndis_get(struct ndis_softc *, uint32_t, void *, uint32_t);
 int	ndis_get_int(struct ndis_softc *, uint32_t, uint32_t *);
 int	ndis_get_info(struct ndis_softc *, uint32_t, void *, uint32_t,
@@ -2201,6 +2258,9 @@ void	ndis_pnp_event_nic(struct ndis_softc *, uint32_t, uint32_t);
 uint8_t	ndis_check_for_hang_nic(struct ndis_softc *);
 int32_t	ndis_init_nic(struct ndis_softc *);
 void	ndis_return_packet(struct mbuf *, void *, void *);
+u_int	ndis_intr_run(struct ndis_softc *, struct ndis_miniport_interrupt *);
+void	ndis_return_flush(struct ndis_miniport_block *);
+void	ndis_return_flush_locked(struct ndis_miniport_block *);
 int	ndis_init_dma(struct ndis_softc *);
 void	ndis_destroy_dma(struct ndis_softc *);
 int	ndis_add_sysctl(struct ndis_softc *, char *, char *, char *, int);
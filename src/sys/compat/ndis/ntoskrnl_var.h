@@ -151,13 +151,30 @@ struct slist_entry {
 	struct slist_entry *sl_next;
 };
 
-union slist_header {  /* FIXME: amd64 */
+/*
+ * The header is updated as a unit with cmpxchg8b (i386) or cmpxchg16b
+ * (amd64); the latter needs it 16 bytes wide and 16-byte aligned, as
+ * the Windows SLIST_HEADER is. Drivers may read the depth straight
+ * out of the header, so the fields sit where Windows puts them: on
+ * x64 the depth and sequence share the first quadword and the next
+ * entry pointer fills the second.
+ */
+union slist_header {
+#ifdef __amd64__
+	uint64_t	slh_align[2] __aligned(16);
+	struct {
+		uint64_t		slh_depth:16;
+		uint64_t		slh_seq:48;
+		struct slist_entry	*slh_next;
+	} slh_list;
+#else
 	uint64_t	slh_align;
 	struct {
 		struct slist_entry	*slh_next;
 		uint16_t 		slh_depth;
 		uint16_t		slh_seq;
 	} slh_list;
+#endif
 };
 
 struct list_entry {
@@ -465,12 +482,15 @@ struct nt_kinterrupt;
 typedef uint8_t (*service_func)(struct nt_kinterrupt *interrupt, void *ctx);
 typedef uint8_t (*synchronize_func)(void *ctx);
 
+struct nt_intvec;
+
 struct nt_kinterrupt {
 	struct list_entry	list;
 	unsigned long		lock_priv;
 	unsigned long		*lock;
 	service_func		func;
 	void			*ctx;
+	struct nt_intvec	*vec;
 };
 
 struct object_attributes {
@@ -938,7 +958,7 @@ struct irp {
 #define	IRP_NDISUSB_EP(irp) (irp)->tail.misc.usb.ep
 
 #define	InterlockedExchangePointer(dst, val)				\
-	(void *)InterlockedExchange((uint32_t *)(dst), (uintptr_t)(val))
+	(void *)atomic_swap_ptr((volatile uintptr_t *)(dst), (uintptr_t)(val))
 
 #define	IoSizeOfIrp(ssize)						\
 	((uint16_t) (sizeof(struct irp) +				\
@@ -1185,6 +1205,8 @@ void	windrv_unwrap_table(struct image_patch_table *);
 void	ntoskrnl_libinit(void);
 void	ntoskrnl_libfini(void);
 void	ntoskrnl_intr(void *);
+struct nt_intvec *ntoskrnl_intr_vector(uint32_t);
+void	ntoskrnl_intr_vector_release(struct nt_intvec *);
 void	ntoskrnl_time(uint64_t *);
 void	schedule_ndis_work_item(void *);
 void	flush_queue(void);
@@ -1229,7 +1251,8 @@ uint8_t	KeAcquireInterruptSpinLock(struct nt_kinterrupt *);
 void	KeReleaseInterruptSpinLock(struct nt_kinterrupt *, uint8_t);
 uint8_t	KeSynchronizeExecution(struct nt_kinterrupt *, synchronize_func,
 	    void *);
-uintptr_t	InterlockedExchange(volatile uint32_t *, uintptr_t);
+uint32_t	InterlockedExchange(volatile uint32_t *, uint32_t);
+void	ExInterlockedAddLargeStatistic(volatile uint64_t *, uint32_t);
 void	*ExAllocatePool(size_t);
 void	ExFreePool(void *);
 void	MmBuildMdlForNonPagedPool(struct mdl *);
@@ -40,6 +40,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/mutex.h>
 #include <sys/proc.h>
 #include <sys/sched.h>
+#include <sys/smp.h>
 #include <sys/module.h>
 #include <sys/malloc.h>
 #include <sys/queue.h>
@@ -72,21 +73,34 @@ static void	WRITE_PORT_UCHAR(uint8_t *, uint8_t);
 static void	_KeLowerIrql(uint8_t);
 static void	dummy(void);
 
-static struct mtx disp_lock;
+/*
+ * DISPATCH_LEVEL is emulated per CPU: a thread raising to it pins
+ * itself to its current CPU and takes that CPU's dispatch lock. This
+ * keeps other DISPATCH level code off the CPU while it runs there,
+ * much like Windows holding off the scheduler, without serializing
+ * DISPATCH level code on different CPUs. Lock ownership doubles as
+ * the per-thread IRQL for KeGetCurrentIrql().
+ */
+static struct mtx_padalign disp_lock[MAXCPU];
 
 void
 hal_libinit(void)
 {
+	int i;
 
-	mtx_init(&disp_lock, "HAL lock", NULL, MTX_DEF | MTX_RECURSE);
+	CPU_FOREACH(i)
+		mtx_init(&disp_lock[i], "HAL lock", NULL,
+		    MTX_DEF | MTX_RECURSE);
 	windrv_wrap_table(hal_functbl);
 }
 
 void
 hal_libfini(void)
 {
+	int i;
 
-	mtx_destroy(&disp_lock);
+	CPU_FOREACH(i)
+		mtx_destroy(&disp_lock[i]);
 	windrv_unwrap_table(hal_functbl);
 }
 
@@ -207,10 +221,14 @@ KfReleaseSpinLock(unsigned long *lock, uint8_t newirql)
 	KeLowerIrql(newirql);
 }
 
+/*
+ * A thread at DISPATCH_LEVEL is pinned, so td_oncpu is stable. One at
+ * PASSIVE_LEVEL owns none of the locks, whichever CPU it looks at.
+ */
 uint8_t
 KeGetCurrentIrql(void)
 {
-	if (mtx_owned(&disp_lock))
+	if (mtx_owned(&disp_lock[curthread->td_oncpu]))
 		return (DISPATCH_LEVEL);
 	return (PASSIVE_LEVEL);
 }
@@ -230,10 +248,13 @@ KfRaiseIrql(uint8_t newirql)
 	uint8_t oldirql;
 
 	TRACE(NDBG_HAL, "newirql %u\n", newirql);
+	sched_pin();
 	oldirql = KeGetCurrentIrql();
 	KASSERT(oldirql <= newirql, ("newirql not less"));
 	if (oldirql != DISPATCH_LEVEL)
-		mtx_lock(&disp_lock);
+		mtx_lock(&disp_lock[curthread->td_oncpu]);
+	else
+		sched_unpin();
 	return (oldirql);
 }
 
@@ -245,7 +266,8 @@ KfLowerIrql(uint8_t oldirql)
 		return;
 
 	KASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL, ("irql not greater"));
-	mtx_unlock(&disp_lock);
+	mtx_unlock(&disp_lock[curthread->td_oncpu]);
+	sched_unpin();
 }
 
 static uint8_t
@@ -55,6 +55,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/systm.h>
 #include <sys/malloc.h>
 #include <sys/lock.h>
+#include <sys/counter.h>
 #include <sys/socket.h>
 #include <sys/sysctl.h>
 #include <sys/timespec.h>
@@ -221,6 +222,8 @@ static void *NdisBufferVirtualAddressSafe(struct mdl *, uint32_t);
 static void NdisAdjustBufferLength(struct mdl *, uint32_t);
 static int32_t NdisInterlockedIncrement(int32_t *);
 static int32_t NdisInterlockedDecrement(int32_t *);
+static void NdisInterlockedAddLargeInterger(uint64_t *, uint32_t,
+    struct ndis_spin_lock *);
 static void NdisInitializeEvent(struct ndis_event *);
 static void NdisSetEvent(struct ndis_event *);
 static void NdisResetEvent(struct ndis_event *);
@@ -727,30 +730,85 @@ NdisDprReleaseSpinLock(struct ndis_spin_lock *lock)
 static void
 NdisInitializeReadWriteLock(struct ndis_rw_lock *lock)
 {
-	KeInitializeSpinLock(&lock->u.spinlock);
-	memset(&lock->reserved, 0, sizeof(lock->reserved));
+	memset(lock, 0, sizeof(*lock));
+	KeInitializeSpinLock(&lock->u.s.spinlock);
 }
 
+/*
+ * Readers bump their CPU's count at DISPATCH_LEVEL, which keeps them
+ * on the CPU and shuts out every other reader there, so a non-zero
+ * count means this is a nested acquire and may go ahead even with a
+ * writer waiting. A first acquire backs off while the spinlock is
+ * held. Writers take the spinlock and then wait for all counts to
+ * drain to zero.
+ */
 static void
 NdisAcquireReadWriteLock(struct ndis_rw_lock *lock, uint8_t writeacc,
     struct ndis_lock_state *state)
 {
+	struct ndis_rw_refcount *rc;
+	uint32_t v;
+	int i;
+
 	if (writeacc == TRUE) {
-		KeAcquireSpinLock(&lock->u.spinlock, &state->oldirql);
-		lock->reserved[0]++;
+		KeAcquireSpinLock(&lock->u.s.spinlock, &state->oldirql);
+		atomic_set_32(&lock->u.s.shared, NDIS_RW_WRITER);
+		while (lock->u.s.shared != NDIS_RW_WRITER)
+			cpu_spinwait();
+		for (i = 0; i <= mp_maxid && i < NDIS_RW_MAXCPU; i++)
+			while (lock->refcount[i].count != 0)
+				cpu_spinwait();
+		state->lockstate = NDIS_RW_STATE_WRITE;
+		return;
+	}
+
+	KeRaiseIrql(DISPATCH_LEVEL, &state->oldirql);
+	i = curcpu;
+	if (i >= NDIS_RW_MAXCPU) {
+		for (;;) {
+			v = lock->u.s.shared;
+			if (v == NDIS_RW_WRITER)
+				cpu_spinwait();
+			else if (atomic_cmpset_32(&lock->u.s.shared, v, v + 1))
+				break;
+		}
+		state->lockstate = NDIS_RW_STATE_SHARED;
+		return;
+	}
+
+	rc = &lock->refcount[i];
+	if (rc->count == 0) {
+		for (;;) {
+			atomic_add_32(&rc->count, 1);
+			if (atomic_load_acq_long(&lock->u.s.spinlock) == 0)
+				break;
+			atomic_subtract_32(&rc->count, 1);
+			while (atomic_load_acq_long(&lock->u.s.spinlock) != 0)
+				cpu_spinwait();
+		}
 	} else
-		lock->reserved[1]++;
+		atomic_add_32(&rc->count, 1);
+	state->lockstate = i;
 }
 
 static void
 NdisReleaseReadWriteLock(struct ndis_rw_lock *lock,
     struct ndis_lock_state *state)
 {
-	if (lock->reserved[0]) {
-		lock->reserved[0]--;
-		KeReleaseSpinLock(&lock->u.spinlock, state->oldirql);
-	} else
-		lock->reserved[1]--;
+	switch (state->lockstate) {
+	case NDIS_RW_STATE_WRITE:
+		atomic_clear_32(&lock->u.s.shared, NDIS_RW_WRITER);
+		KeReleaseSpinLock(&lock->u.s.spinlock, state->oldirql);
+		return;
+	case NDIS_RW_STATE_SHARED:
+		atomic_subtract_rel_32(&lock->u.s.shared, 1);
+		break;
+	default:
+		atomic_subtract_rel_32(&lock->refcount[state->lockstate].count,
+		    1);
+		break;
+	}
+	KeLowerIrql(state->oldirql);
 }
 
 static uint32_t
@@ -1728,17 +1786,21 @@ NdisAdjustBufferLength(struct mdl *buf, uint32_t len)
 static int32_t
 NdisInterlockedIncrement(int32_t *addend)
 {
-	atomic_add_int(addend, 1);
-
-	return (*addend);
+	return (atomic_fetchadd_int(addend, 1) + 1);
 }
 
 static int32_t
 NdisInterlockedDecrement(int32_t *addend)
 {
-	atomic_subtract_int(addend, 1);
+	return (atomic_fetchadd_int(addend, -1) - 1);
+}
 
-	return (*addend);
+/* Yes, that is how the export is spelled. The lock is not needed. */
+static void
+NdisInterlockedAddLargeInterger(uint64_t *addend, uint32_t inc,
+    struct ndis_spin_lock *lock)
+{
+	ExInterlockedAddLargeStatistic(addend, inc);
 }
 
 static void
@@ -1824,28 +1886,92 @@ ndis_interrupt_nic(struct nt_kinterrupt *iobj, struct ndis_softc *sc)
 		ndis_disable_interrupts_nic(sc);
 		call_isr = TRUE;
 	}
-	if (call_isr)
+	if (call_isr) {
+		counter_u64_add(sc->ndis_intrs, 1);
 		IoRequestDpc(sc->ndis_block->deviceobj, NULL, sc);
+	}
 	return (is_our_intr);
 }
 
+/*
+ * Run the miniport's HandleInterrupt() once and return how many packets
+ * it indicated or completed meanwhile. Must be called at DISPATCH_LEVEL.
+ */
+u_int
+ndis_intr_run(struct ndis_softc *sc, struct ndis_miniport_interrupt *intr)
+{
+	unsigned long *lock;
+	u_int work;
+
+	/*
+	 * Deserialized miniports don't expect HandleInterrupt() to be
+	 * entered on two CPUs at once either, so ndis_poll() and the
+	 * interrupt DPC still need a lock of their own.
+	 */
+	if (NDIS_SERIALIZED(sc->ndis_block))
+		lock = &sc->ndis_block->lock;
+	else
+		lock = &sc->ndis_intr_runlock;
+	KeAcquireSpinLockAtDpcLevel(lock);
+	sc->ndis_intr_work = 0;
+	sc->ndis_intr_td = curthread;
+	MSCALL1(intr->dpc_func, sc->ndis_block->miniport_adapter_ctx);
+	/* Batch up returns of packets freed since the last interrupt. */
+	ndis_return_flush_locked(sc->ndis_block);
+	sc->ndis_intr_td = NULL;
+	work = sc->ndis_intr_work;
+	KeReleaseSpinLockFromDpcLevel(lock);
+	return (work);
+}
+
 static void
 ndis_intrhand(struct nt_kdpc *kdpc, struct ndis_miniport_interrupt *intr,
     void *sysarg1, void *sysarg2)
 {
 	struct ndis_softc *sc;
+	u_int budget, total, work;
 
 	KASSERT(intr != NULL, ("no intr"));
 	KASSERT(intr->block != NULL, ("no block"));
 	KASSERT(intr->block->miniport_adapter_ctx != NULL, ("no adapter"));
 	KASSERT(intr->block->physdeviceobj != NULL, ("no physdeviceobj"));
 	sc = device_get_softc(intr->block->physdeviceobj->devext);
+
+	/* With DEVICE_POLLING, ndis_poll() calls the miniport instead. */
+	if (sc->ndis_polling)
+		goto done;
+
+	work = ndis_intr_run(sc, intr);
+
+	/*
+	 * Adaptive polling: as long as the miniport keeps finding work,
+	 * leave its interrupts disabled and call it again, until it goes
+	 * quiet or the budget is used up. In the latter case requeue the
+	 * DPC, so other DPCs get to run before we poll some more.
+	 */
+	budget = sc->ndis_poll_budget;
+	if (budget != 0 && work != 0) {
+		for (total = work; work != 0 && total < budget; total += work) {
+			work = ndis_intr_run(sc, intr);
+			counter_u64_add(sc->ndis_polls, 1);
+			counter_u64_add(sc->ndis_poll_pkts, work);
+		}
+		if (work != 0 && intr->block->interrupt != NULL) {
+			KeAcquireSpinLockAtDpcLevel(&intr->dpc_count_lock);
+			if (KeInsertQueueDpc(&intr->interrupt_dpc,
+			    NULL, NULL) == TRUE)
+				intr->dpc_count++;
+			KeReleaseSpinLockFromDpcLevel(&intr->dpc_count_lock);
+			goto done;
+		}
+	}
+
 	if (NDIS_SERIALIZED(sc->ndis_block))
 		KeAcquireSpinLockAtDpcLevel(&intr->block->lock);
-	MSCALL1(intr->dpc_func, intr->block->miniport_adapter_ctx);
 	ndis_enable_interrupts_nic(sc);
 	if (NDIS_SERIALIZED(sc->ndis_block))
 		KeReleaseSpinLockFromDpcLevel(&intr->block->lock);
+done:
 
 	/*
 	 * Set the completion event if we've drained all pending interrupts.
@@ -1864,6 +1990,7 @@ NdisMRegisterInterrupt(struct ndis_miniport_interrupt *intr,
 {
 	struct ndis_miniport_characteristics *ch;
 	struct ndis_softc *sc;
+	int cpu, n;
 
 	TRACE(NDBG_INTR, "intr %p block %p vec %u level %u reqisr %u shared %u "
 	    "mode %d\n", intr, block, vec, level, reqisr, shared, mode);
@@ -1883,7 +2010,22 @@ NdisMRegisterInterrupt(struct ndis_miniport_interrupt *intr,
 
 	KeInitializeEvent(&intr->dpc_completed_event, NOTIFICATION_EVENT, TRUE);
 	KeInitializeDpc(&intr->interrupt_dpc, ndis_intrhand_wrap, intr);
-	KeSetImportanceDpc(&intr->interrupt_dpc, IMPORTANCE_LOW);
+	/* Ahead of the miniport's timers, which are LOW. */
+	KeSetImportanceDpc(&intr->interrupt_dpc, IMPORTANCE_MEDIUM);
+	/*
+	 * DISPATCH_LEVEL code runs concurrently on different CPUs, so
+	 * keep HandleInterrupt() on one CPU's DPC thread. That way it
+	 * never runs twice at once, like NDIS promises. Adapters are
+	 * spread over the present CPUs by unit number.
+	 */
+	n = device_get_unit(sc->ndis_dev) % mp_ncpus;
+	CPU_FOREACH(cpu) {
+		if (n-- == 0)
+			break;
+	}
+	KeSetTargetProcessorDpc(&intr->interrupt_dpc, cpu);
+	KASSERT(intr->interrupt_dpc.num == cpu,
+	    ("interrupt DPC not targeted at CPU %d", cpu));
 
 	if (IoConnectInterrupt(&intr->interrupt_object,
 	    ndis_interrupt_nic_wrap, sc, NULL,
@@ -1901,10 +2043,9 @@ NdisMDeregisterInterrupt(struct ndis_miniport_interrupt *intr)
 	uint8_t irql;
 
 	TRACE(NDBG_INTR, "intr %p\n", intr);
-	/* Should really be KeSynchronizeExecution() */
-	KeAcquireSpinLock(intr->interrupt_object->lock, &irql);
+	irql = KeAcquireInterruptSpinLock(intr->interrupt_object);
 	intr->block->interrupt = NULL;
-	KeReleaseSpinLock(intr->interrupt_object->lock, irql);
+	KeReleaseInterruptSpinLock(intr->interrupt_object, irql);
 /*
 	KeFlushQueuedDpcs();
 */
@@ -2688,6 +2829,7 @@ struct image_patch_table ndis_functbl[] = {
 	IMPORT_SFUNC(NdisInitializeString, 2),
 	IMPORT_SFUNC(NdisInitializeTimer, 3),
 	IMPORT_SFUNC(NdisInitializeWrapper, 4),
+	IMPORT_SFUNC(NdisInterlockedAddLargeInterger, 3),
 	IMPORT_SFUNC(NdisInterlockedDecrement, 1),
 	IMPORT_SFUNC(NdisInterlockedIncrement, 1),
 	IMPORT_SFUNC(NdisInterlockedInsertHeadList, 3),
@@ -41,6 +41,8 @@ __FBSDID("$FreeBSD$");
 #include <sys/malloc.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/priv.h>
+#include <sys/sysctl.h>
 
 #include <sys/kdb.h>
 #include <sys/kernel.h>
@@ -56,6 +58,9 @@ __FBSDID("$FreeBSD$");
 #include <machine/_inttypes.h>
 #include <machine/atomic.h>
 #include <machine/bus.h>
+#include <machine/cpu.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
 #include <machine/stdarg.h>
 #include <machine/resource.h>
 
@@ -77,13 +82,14 @@ __FBSDID("$FreeBSD$");
 #include "ndis_var.h"
 
 struct kdpc_queue {
-	struct list_entry	disp;
+	struct list_entry	disp[IMPORTANCE_HIGH + 1];
 	struct thread		*td;
 	int			exit;
+	int			cpu;
 	unsigned long		lock;
 	struct nt_kevent	proc;
 	struct nt_kevent	done;
-};
+} __aligned(CACHE_LINE_SIZE);
 
 struct wb_ext {
 	struct cv		we_cv;
@@ -95,6 +101,21 @@ struct ndis_work_item_task {
 	struct task tq_item;
 };
 
+/*
+ * One of these exists for every interrupt vector an ISR is connected
+ * to. ntoskrnl_intr() is installed with it as argument, so interrupts
+ * only run the ISRs connected to that vector, under that vector's
+ * lock. With a single ISR connected it's called without a list walk.
+ */
+struct nt_intvec {
+	struct list_entry	link;
+	uint32_t		vector;
+	u_int			refs;
+	unsigned long		lock;
+	struct list_entry	isrs;
+	struct nt_kinterrupt	*single;
+};
+
 static struct list_entry nt_intlist;
 
 #ifdef __amd64__
@@ -145,7 +166,6 @@ static void ntoskrnl_timercall(void *);
 static void ntoskrnl_unicode_to_ascii(uint16_t *, char *, int);
 static void run_ndis_work_item(struct ndis_work_item_task *, int);
 static void IORunWorkItem(struct io_workitem *iw, int pending);
-static uint8_t ntoskrnl_insert_dpc(struct list_entry *, struct nt_kdpc *);
 static void WRITE_REGISTER_USHORT(uint16_t *, uint16_t);
 static uint16_t READ_REGISTER_USHORT(uint16_t *);
 static void WRITE_REGISTER_ULONG(uint32_t *, uint32_t);
@@ -178,7 +198,13 @@ static struct slist_entry *ExInterlockedPopEntrySList(union slist_header *,
 static void InitializeSListHead(union slist_header *);
 static int32_t InterlockedIncrement(volatile int32_t *);
 static int32_t InterlockedDecrement(volatile int32_t *);
-static void ExInterlockedAddLargeStatistic(uint64_t *, uint32_t);
+static int32_t InterlockedExchangeAdd(volatile int32_t *, int32_t);
+static int32_t InterlockedCompareExchange(volatile int32_t *, int32_t,
+    int32_t);
+static uint32_t ExInterlockedAddUlong(volatile uint32_t *, uint32_t,
+    unsigned long *);
+static uint64_t ExInterlockedCompareExchange64(volatile uint64_t *,
+    uint64_t *, uint64_t *);
 static void *MmAllocateContiguousMemory(uint32_t, uint64_t);
 static void *MmAllocateContiguousMemorySpecifyCache(uint32_t, uint64_t,
     uint64_t, uint64_t, enum memory_caching_type);
@@ -302,7 +328,7 @@ static uint8_t ntoskrnl_kth;
 static struct nt_objref_head nt_reflist;
 static uma_zone_t mdl_zone;
 static uma_zone_t iw_zone;
-static struct kdpc_queue *kq_queue;
+static struct kdpc_queue *kq_queues;	/* indexed by CPU id */
 static struct taskqueue *nq_queue;
 static struct taskqueue *wq_queue;
 
@@ -311,7 +337,9 @@ MALLOC_DEFINE(M_NDIS_NTOSKRNL, "ndis_ntoskrnl", "ndis_ntoskrnl buffers");
 void
 ntoskrnl_libinit(void)
 {
+	struct kdpc_queue *kq;
 	struct thread *t;
+	int i;
 
 	mtx_init(&nt_dispatchlock, "dispatchlock", NULL, MTX_DEF | MTX_RECURSE);
 	mtx_init(&nt_interlock, "interlock", NULL, MTX_SPIN);
@@ -321,17 +349,21 @@ ntoskrnl_libinit(void)
 
 	InitializeListHead(&nt_intlist);
 
-	kq_queue = ExAllocatePool(sizeof(struct kdpc_queue));
-	if (kq_queue == NULL)
-		panic("failed to allocate kq_queue");
-
-	InitializeListHead(&kq_queue->disp);
-	KeInitializeSpinLock(&kq_queue->lock);
-	KeInitializeEvent(&kq_queue->proc, SYNCHRONIZATION_EVENT, FALSE);
-	KeInitializeEvent(&kq_queue->done, SYNCHRONIZATION_EVENT, FALSE);
-	if (kproc_kthread_add(ntoskrnl_dpc_thread, kq_queue, &ndisproc,
-	    &t, RFHIGHPID, NDIS_KSTACK_PAGES, "ndis", "dpc"))
-		panic("failed to launch dpc thread");
+	kq_queues = malloc(sizeof(struct kdpc_queue) * (mp_maxid + 1),
+	    M_NDIS_NTOSKRNL, M_WAITOK|M_ZERO);
+	CPU_FOREACH(i) {
+		kq = &kq_queues[i];
+		kq->cpu = i;
+		InitializeListHead(&kq->disp[IMPORTANCE_LOW]);
+		InitializeListHead(&kq->disp[IMPORTANCE_MEDIUM]);
+		InitializeListHead(&kq->disp[IMPORTANCE_HIGH]);
+		KeInitializeSpinLock(&kq->lock);
+		KeInitializeEvent(&kq->proc, SYNCHRONIZATION_EVENT, FALSE);
+		KeInitializeEvent(&kq->done, SYNCHRONIZATION_EVENT, FALSE);
+		if (kproc_kthread_add(ntoskrnl_dpc_thread, kq, &ndisproc,
+		    &t, RFHIGHPID, NDIS_KSTACK_PAGES, "ndis", "dpc%d", i))
+			panic("failed to launch dpc thread");
+	}
 
 	if ((nq_queue = taskqueue_create("ndis queue", M_WAITOK,
 	    taskqueue_thread_enqueue, &nq_queue)) == NULL)
@@ -382,7 +414,7 @@ ntoskrnl_libfini(void)
 
 	taskqueue_free(wq_queue);
 	taskqueue_free(nq_queue);
-	ExFreePool(kq_queue);
+	free(kq_queues, M_NDIS_NTOSKRNL);
 
 	uma_zdestroy(mdl_zone);
 	uma_zdestroy(iw_zone);
@@ -1122,30 +1154,113 @@ IofCompleteRequest(struct irp *ip, uint8_t prioboost)
 	}
 }
 
+/*
+ * The ISRs run from the interrupt thread, not from a filter: MSCALL
+ * on amd64 borrows an FPU context, which takes sleep mutexes and may
+ * allocate, none of which is allowed in a filter or under a spin
+ * mutex.
+ */
 void
 ntoskrnl_intr(void *arg)
 {
+	struct nt_intvec *iv = arg;
 	struct nt_kinterrupt *iobj;
 	uint8_t irql;
 	uint8_t claimed;
 	struct list_entry *l;
 
-	KeAcquireSpinLock(&nt_intlock, &irql);
-	for (l = nt_intlist.flink; l != &nt_intlist; l = l->flink) {
+	KeAcquireSpinLock(&iv->lock, &irql);
+	if ((iobj = iv->single) != NULL) {
+		MSCALL2(iobj->func, iobj, iobj->ctx);
+		KeReleaseSpinLock(&iv->lock, irql);
+		return;
+	}
+	for (l = iv->isrs.flink; l != &iv->isrs; l = l->flink) {
 		iobj = CONTAINING_RECORD(l, struct nt_kinterrupt, list);
 		claimed = MSCALL2(iobj->func, iobj, iobj->ctx);
 		if (claimed == TRUE)
 			break;
 	}
+	KeReleaseSpinLock(&iv->lock, irql);
+}
+
+/*
+ * Look up the dispatch state for an interrupt vector, creating it for
+ * the first user, and take a reference on it. The result is what
+ * ntoskrnl_intr() wants as its argument.
+ */
+struct nt_intvec *
+ntoskrnl_intr_vector(uint32_t vector)
+{
+	struct nt_intvec *iv, *niv;
+	struct list_entry *l;
+	uint8_t irql;
+
+	niv = ExAllocatePool(sizeof(struct nt_intvec));
+	if (niv == NULL)
+		return (NULL);
+
+	KeAcquireSpinLock(&nt_intlock, &irql);
+	for (l = nt_intlist.flink; l != &nt_intlist; l = l->flink) {
+		iv = CONTAINING_RECORD(l, struct nt_intvec, link);
+		if (iv->vector == vector) {
+			iv->refs++;
+			KeReleaseSpinLock(&nt_intlock, irql);
+			ExFreePool(niv);
+			return (iv);
+		}
+	}
+	niv->vector = vector;
+	niv->refs = 1;
+	niv->single = NULL;
+	KeInitializeSpinLock(&niv->lock);
+	InitializeListHead(&niv->isrs);
+	InsertHeadList(&nt_intlist, &niv->link);
+	KeReleaseSpinLock(&nt_intlock, irql);
+
+	return (niv);
+}
+
+void
+ntoskrnl_intr_vector_release(struct nt_intvec *iv)
+{
+	uint8_t irql;
+
+	KeAcquireSpinLock(&nt_intlock, &irql);
+	if (--iv->refs != 0) {
+		KeReleaseSpinLock(&nt_intlock, irql);
+		return;
+	}
+	RemoveEntryList(&iv->link);
 	KeReleaseSpinLock(&nt_intlock, irql);
+
+	KASSERT(IsListEmpty(&iv->isrs), ("ISRs still connected"));
+	ExFreePool(iv);
 }
 
+/* Called with the vector lock held whenever its ISR list changes. */
+static void
+ntoskrnl_intr_update(struct nt_intvec *iv)
+{
+
+	if (!IsListEmpty(&iv->isrs) && iv->isrs.flink == iv->isrs.blink)
+		iv->single = CONTAINING_RECORD(iv->isrs.flink,
+		    struct nt_kinterrupt, list);
+	else
+		iv->single = NULL;
+}
+
+/*
+ * The ISR runs from ntoskrnl_intr() with the vector's lock held, so
+ * that is what keeps it out.
+ */
 uint8_t
 KeAcquireInterruptSpinLock(struct nt_kinterrupt *iobj)
 {
 	uint8_t irql;
 
-	KeAcquireSpinLock(iobj->lock, &irql);
+	KASSERT(iobj->vec != NULL, ("not connected"));
+	KeAcquireSpinLock(&iobj->vec->lock, &irql);
 
 	return (irql);
 }
@@ -1153,7 +1268,7 @@ KeAcquireInterruptSpinLock(struct nt_kinterrupt *iobj)
 void
 KeReleaseInterruptSpinLock(struct nt_kinterrupt *iobj, uint8_t irql)
 {
-	KeReleaseSpinLock(iobj->lock, irql);
+	KeReleaseSpinLock(&iobj->vec->lock, irql);
 }
 
 uint8_t
@@ -1163,12 +1278,11 @@ KeSynchronizeExecution(struct nt_kinterrupt *iobj, synchronize_func func,
 	uint8_t irql, rval;
 
 	KASSERT(iobj != NULL, ("no iobj"));
-	KASSERT(iobj->lock != NULL, ("no lock"));
 	KASSERT(func != NULL, ("no func"));
 	KASSERT(ctx != NULL, ("no ctx"));
-	KeAcquireSpinLock(iobj->lock, &irql);
+	irql = KeAcquireInterruptSpinLock(iobj);
 	rval = MSCALL1(func, ctx);
-	KeReleaseSpinLock(iobj->lock, irql);
+	KeReleaseInterruptSpinLock(iobj, irql);
 
 	return (rval);
 }
@@ -1180,24 +1294,30 @@ KeSynchronizeExecution(struct nt_kinterrupt *iobj, synchronize_func func,
  * bus_setup_intr(), which needs the device_t for the device
  * requesting interrupt delivery. In order to bypass this
  * inconsistency, we implement a second level of interrupt
- * dispatching on top of bus_setup_intr(). All devices use
- * ntoskrnl_intr() as their ISR, and any device requesting
- * interrupts will be registered with ntoskrnl_intr()'s interrupt
- * dispatch list. When an interrupt arrives, we walk the list
- * and invoke all the registered ISRs. This effectively makes all
- * interrupts shared, but it's the only way to duplicate the
- * semantics of IoConnectInterrupt() and IoDisconnectInterrupt() properly.
+ * dispatching on top of bus_setup_intr(). The bus front end
+ * installs ntoskrnl_intr() for its interrupt resource with the
+ * state from ntoskrnl_intr_vector() as argument, and ISRs are
+ * connected to that same state by vector number. When an interrupt
+ * arrives, only the ISRs connected to its vector are invoked.
  */
 int32_t
 IoConnectInterrupt(struct nt_kinterrupt **iobj, void *func, void *ctx,
     unsigned long *lock, uint32_t vector, uint8_t irql, uint8_t syncirql,
     uint8_t imode, uint8_t shared, uint32_t affinity, uint8_t savefloat)
 {
+	struct nt_intvec *iv;
 	uint8_t curirql;
 
 	*iobj = ExAllocatePool(sizeof(struct nt_kinterrupt));
 	if (*iobj == NULL)
 		return (NDIS_STATUS_RESOURCES);
+	iv = ntoskrnl_intr_vector(vector);
+	if (iv == NULL) {
+		ExFreePool(*iobj);
+		*iobj = NULL;
+		return (NDIS_STATUS_RESOURCES);
+	}
+	(*iobj)->vec = iv;
 
 	(*iobj)->func = func;
 	(*iobj)->ctx = ctx;
@@ -1208,9 +1328,10 @@ IoConnectInterrupt(struct nt_kinterrupt **iobj, void *func, void *ctx,
 	} else
 		(*iobj)->lock = lock;
 
-	KeAcquireSpinLock(&nt_intlock, &curirql);
-	InsertHeadList(&nt_intlist, &(*iobj)->list);
-	KeReleaseSpinLock(&nt_intlock, curirql);
+	KeAcquireSpinLock(&iv->lock, &curirql);
+	InsertHeadList(&iv->isrs, &(*iobj)->list);
+	ntoskrnl_intr_update(iv);
+	KeReleaseSpinLock(&iv->lock, curirql);
 
 	return (NDIS_STATUS_SUCCESS);
 }
@@ -1218,14 +1339,18 @@ IoConnectInterrupt(struct nt_kinterrupt **iobj, void *func, void *ctx,
 void
 IoDisconnectInterrupt(struct nt_kinterrupt *iobj)
 {
+	struct nt_intvec *iv;
 	uint8_t irql;
 
 	if (iobj == NULL)
 		return;
 
-	KeAcquireSpinLock(&nt_intlock, &irql);
+	iv = iobj->vec;
+	KeAcquireSpinLock(&iv->lock, &irql);
 	RemoveEntryList(&iobj->list);
-	KeReleaseSpinLock(&nt_intlock, irql);
+	ntoskrnl_intr_update(iv);
+	KeReleaseSpinLock(&iv->lock, irql);
+	ntoskrnl_intr_vector_release(iv);
 
 	ExFreePool(iobj);
 }
@@ -1895,29 +2020,81 @@ _aullshr(uint64_t a, uint8_t b)
 	return (a >> b);
 }
 
+/*
+ * Singly linked lists are lock-free stacks. The header carries the
+ * first entry, the depth and a sequence number bumped by every push
+ * and pop, and is replaced as a whole with one compare-and-swap, so
+ * a pop that loses a race against a pop and re-push of the same
+ * entry fails its compare rather than installing a stale next link.
+ * As on Windows, a pop may read sl_next from an entry another CPU
+ * has just taken; packet pool and lookaside memory stays mapped, so
+ * that value is only stale and the compare throws it away.
+ */
+static __inline int
+ntoskrnl_slist_cas(union slist_header *head, union slist_header *old,
+    union slist_header *new)
+{
+#ifdef __amd64__
+	uint64_t lo, hi;
+	u_char res;
+
+	if ((cpu_feature2 & CPUID2_CX16) == 0) {
+		/* The earliest AMD64 parts have no cmpxchg16b. */
+		mtx_lock_spin(&nt_interlock);
+		res = head->slh_align[0] == old->slh_align[0] &&
+		    head->slh_align[1] == old->slh_align[1];
+		if (res)
+			*head = *new;
+		mtx_unlock_spin(&nt_interlock);
+		return (res);
+	}
+
+	lo = old->slh_align[0];
+	hi = old->slh_align[1];
+	__asm __volatile("lock; cmpxchg16b %1; sete %0"
+	    : "=q" (res), "+m" (*head), "+a" (lo), "+d" (hi)
+	    : "b" (new->slh_align[0]), "c" (new->slh_align[1])
+	    : "memory", "cc");
+	return (res);
+#else
+	return (atomic_cmpset_64(&head->slh_align, old->slh_align,
+	    new->slh_align));
+#endif
+}
+
 static struct slist_entry *
 ntoskrnl_pushsl(union slist_header *head, struct slist_entry *entry)
 {
-	struct slist_entry *oldhead;
+	union slist_header old, new;
 
-	oldhead = head->slh_list.slh_next;
-	entry->sl_next = head->slh_list.slh_next;
-	head->slh_list.slh_next = entry;
-	head->slh_list.slh_depth++;
+	do {
+		old = *head;
+		new = old;
+		entry->sl_next = old.slh_list.slh_next;
+		new.slh_list.slh_next = entry;
+		new.slh_list.slh_depth++;
+		new.slh_list.slh_seq++;
+	} while (!ntoskrnl_slist_cas(head, &old, &new));
 
-	return (oldhead);
+	return (old.slh_list.slh_next);
 }
 
 static struct slist_entry *
 ntoskrnl_popsl(union slist_header *head)
 {
+	union slist_header old, new;
 	struct slist_entry *first;
 
-	first = head->slh_list.slh_next;
-	if (first != NULL) {
-		head->slh_list.slh_next = first->sl_next;
-		head->slh_list.slh_depth--;
-	}
+	do {
+		old = *head;
+		first = old.slh_list.slh_next;
+		if (first == NULL)
+			return (NULL);
+		new = old;
+		new.slh_list.slh_next = first->sl_next;
+		new.slh_list.slh_depth--;
+		new.slh_list.slh_seq++;
+	} while (!ntoskrnl_slist_cas(head, &old, &new));
 
 	return (first);
 }
@@ -1986,25 +2163,13 @@ ExDeleteNPagedLookasideList(struct npaged_lookaside_list *lookaside)
 struct slist_entry *
 InterlockedPushEntrySList(union slist_header *head, struct slist_entry *entry)
 {
-	struct slist_entry *oldhead;
-
-	mtx_lock_spin(&nt_interlock);
-	oldhead = ntoskrnl_pushsl(head, entry);
-	mtx_unlock_spin(&nt_interlock);
-
-	return (oldhead);
+	return (ntoskrnl_pushsl(head, entry));
 }
 
 struct slist_entry *
 InterlockedPopEntrySList(union slist_header *head)
 {
-	struct slist_entry *first;
-
-	mtx_lock_spin(&nt_interlock);
-	first = ntoskrnl_popsl(head);
-	mtx_unlock_spin(&nt_interlock);
-
-	return (first);
+	return (ntoskrnl_popsl(head));
 }
 
 static void
@@ -2029,39 +2194,273 @@ ExInterlockedPopEntrySList(union slist_header *head, unsigned long *lock)
 uint16_t
 ExQueryDepthSList(union slist_header *head)
 {
-	uint16_t depth;
+	return (((volatile union slist_header *)head)->slh_list.slh_depth);
+}
+
+/*
+ * debug.ndis_slistbench: have one thread, then one per CPU, pop and
+ * re-push entries of a shared list, and check that no entry was lost
+ * or duplicated along the way.
+ */
+#define	NT_SLIST_BENCH_LOOPS	1000000
+#define	NT_SLIST_BENCH_ENTRIES	64
+#define	NT_SLIST_BENCH_THREADS	16
+
+struct nt_slist_bench {
+	union slist_header	head;
+	volatile u_int		go;
+	volatile u_int		running;
+	volatile u_int		ticket;
+	sbintime_t		done[NT_SLIST_BENCH_THREADS];
+	struct slist_entry	ent[NT_SLIST_BENCH_ENTRIES];
+};
+
+static void
+ntoskrnl_slist_bench_thread(void *arg)
+{
+	struct nt_slist_bench *b = arg;
+	struct slist_entry *e;
+	int i;
+
+	while (atomic_load_acq_int(&b->go) == 0)
+		cpu_spinwait();
+	for (i = 0; i < NT_SLIST_BENCH_LOOPS; i++) {
+		e = InterlockedPopEntrySList(&b->head);
+		if (e != NULL)
+			InterlockedPushEntrySList(&b->head, e);
+	}
+	b->done[atomic_fetchadd_int(&b->ticket, 1)] = sbinuptime();
+	atomic_subtract_rel_int(&b->running, 1);
+	kthread_exit();
+}
+
+/* Returns the wall time per pop/push pair in hundredths of a ns. */
+static int
+ntoskrnl_slist_bench_run(struct nt_slist_bench *b, int nthreads,
+    uint64_t *cost)
+{
+	sbintime_t t0, t1;
+	int error, i;
+
+	b->go = 0;
+	b->ticket = 0;
+	b->running = nthreads;
+	error = 0;
+	for (i = 0; i < nthreads; i++) {
+		error = kthread_add(ntoskrnl_slist_bench_thread, b, NULL,
+		    NULL, 0, 0, "slbench%d", i);
+		if (error) {
+			atomic_subtract_int(&b->running, nthreads - i);
+			nthreads = i;
+			break;
+		}
+	}
+
+	t0 = sbinuptime();
+	atomic_store_rel_int(&b->go, 1);
+	while (atomic_load_acq_int(&b->running) != 0)
+		pause("slbench", 1);
+
+	t1 = t0;
+	for (i = 0; i < nthreads; i++)
+		if (b->done[i] > t1)
+			t1 = b->done[i];
+	*cost = sbttons(t1 - t0) * 100 / NT_SLIST_BENCH_LOOPS;
+
+	return (error);
+}
+
+static int
+ntoskrnl_sysctl_slistbench(SYSCTL_HANDLER_ARGS)
+{
+	struct nt_slist_bench *b;
+	struct slist_entry *e;
+	uint64_t one, all;
+	char buf[80];
+	int error, i, n;
+
+	error = priv_check(req->td, PRIV_DRIVER);
+	if (error)
+		return (error);
+
+	/* The list head must be 16-byte aligned; malloc(9) ensures that. */
+	b = malloc(sizeof(*b), M_NDIS_NTOSKRNL, M_WAITOK|M_ZERO);
+	InitializeSListHead(&b->head);
+	for (i = 0; i < NT_SLIST_BENCH_ENTRIES; i++)
+		InterlockedPushEntrySList(&b->head, &b->ent[i]);
+
+	n = min(mp_ncpus, NT_SLIST_BENCH_THREADS);
+	error = ntoskrnl_slist_bench_run(b, 1, &one);
+	if (error == 0)
+		error = ntoskrnl_slist_bench_run(b, n, &all);
+	if (error == 0) {
+		i = 0;
+		for (e = b->head.slh_list.slh_next; e != NULL; e = e->sl_next)
+			i++;
+		if (i != NT_SLIST_BENCH_ENTRIES ||
+		    ExQueryDepthSList(&b->head) != i)
+			error = EIO;
+	}
+	free(b, M_NDIS_NTOSKRNL);
+	if (error)
+		return (error);
 
-	mtx_lock_spin(&nt_interlock);
-	depth = head->slh_list.slh_depth;
-	mtx_unlock_spin(&nt_interlock);
+	snprintf(buf, sizeof(buf), "%ju.%02ju ns per pop/push pair, "
+	    "%ju.%02ju ns with %d threads", (uintmax_t)one / 100,
+	    (uintmax_t)one % 100, (uintmax_t)all / 100, (uintmax_t)all % 100,
+	    n);
 
-	return (depth);
+	return (sysctl_handle_string(oidp, buf, 0, req));
 }
 
+SYSCTL_PROC(_debug, OID_AUTO, ndis_slistbench,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    ntoskrnl_sysctl_slistbench, "A",
+    "Cost of an NDIS SList pop/push pair, alone and contended");
+
 void
 KeInitializeSpinLock(unsigned long *lock)
 {
 	*lock = 0;
 }
 
+/*
+ * Emulated spinlocks. They are only held at DISPATCH_LEVEL, which
+ * the HAL implements by owning the current CPU's dispatch mutex, so
+ * other DISPATCH level code can't get onto the holder's CPU and
+ * there's no need to boost the holder's priority. Contenders spin
+ * on plain loads with exponential backoff and only retry the CAS
+ * once the lock looks free, to keep the cache line shared while it
+ * is held.
+ *
+ * Miniports do call into code that may block while holding one of
+ * these locks. If the holder is waiting on a mutex owned by a thread
+ * that can only run on the contender's CPU, spinning there forever
+ * would livelock, so after NT_SPIN_YIELD rounds a contender running
+ * in thread context gives up the CPU to anything else runnable on it
+ * before it goes back to spinning.
+ */
+#define	NT_SPIN_BACKOFF_MAX	64
+#define	NT_SPIN_YIELD		256
+
+static void
+ntoskrnl_spin_yield(void)
+{
+	struct thread *td = curthread;
+	u_char pri;
+
+	if (td->td_critnest != 0 || td->td_intr_nesting_level != 0)
+		return;
+	pri = td->td_base_pri;
+	kern_yield(PRI_MAX_TIMESHARE);
+	thread_lock(td);
+	sched_prio(td, pri);
+	thread_unlock(td);
+}
+
+static __inline void
+ntoskrnl_spin_lock(unsigned long *lock)
+{
+	volatile u_int *l = (volatile u_int *)lock;
+	u_int backoff, i, rounds;
+
+	backoff = 1;
+	rounds = 0;
+	while (atomic_cmpset_acq_int(l, 0, 1) == 0) {
+		do {
+			if (++rounds == NT_SPIN_YIELD) {
+				ntoskrnl_spin_yield();
+				rounds = 0;
+			}
+			for (i = 0; i < backoff; i++)
+				cpu_spinwait();
+			if (backoff < NT_SPIN_BACKOFF_MAX)
+				backoff <<= 1;
+		} while (*l != 0);
+	}
+}
+
+static __inline void
+ntoskrnl_spin_unlock(unsigned long *lock)
+{
+
+	atomic_store_rel_int((volatile u_int *)lock, 0);
+}
+
+/*
+ * debug.ndis_spinbench: time uncontended acquire/release pairs, and
+ * for comparison the same pairs with the priority changes the
+ * emulated spinlocks used to make around each acquire and release.
+ */
+#define	NT_SPIN_BENCH_LOOPS	1000000
+
+static int
+ntoskrnl_sysctl_spinbench(SYSCTL_HANDLER_ARGS)
+{
+	struct thread *td = curthread;
+	unsigned long lock;
+	sbintime_t t0, t1, t2;
+	uint64_t now, old;
+	uint8_t irql;
+	u_char pri;
+	char buf[80];
+	int error, i;
+
+	error = priv_check(req->td, PRIV_DRIVER);
+	if (error)
+		return (error);
+
+	KeInitializeSpinLock(&lock);
+	pri = td->td_base_pri;
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	t0 = sbinuptime();
+	for (i = 0; i < NT_SPIN_BENCH_LOOPS; i++) {
+		KeAcquireSpinLockAtDpcLevel(&lock);
+		KeReleaseSpinLockFromDpcLevel(&lock);
+	}
+	t1 = sbinuptime();
+	for (i = 0; i < NT_SPIN_BENCH_LOOPS; i++) {
+		ntoskrnl_spin_lock(&lock);
+		thread_lock(td);
+		sched_prio(td, PRI_MIN_KERN);
+		thread_unlock(td);
+		ntoskrnl_spin_unlock(&lock);
+		thread_lock(td);
+		sched_prio(td, PRI_MIN_KERN + 20);
+		thread_unlock(td);
+	}
+	t2 = sbinuptime();
+	KeLowerIrql(irql);
+	thread_lock(td);
+	sched_prio(td, pri);
+	thread_unlock(td);
+
+	/* In hundredths of a nanosecond per pair. */
+	now = sbttons(t1 - t0) * 100 / NT_SPIN_BENCH_LOOPS;
+	old = sbttons(t2 - t1) * 100 / NT_SPIN_BENCH_LOOPS;
+	snprintf(buf, sizeof(buf), "%ju.%02ju ns per pair, %ju.%02ju ns with "
+	    "priority changes", (uintmax_t)now / 100, (uintmax_t)now % 100,
+	    (uintmax_t)old / 100, (uintmax_t)old % 100);
+
+	return (sysctl_handle_string(oidp, buf, 0, req));
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, ndis_spinbench,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    ntoskrnl_sysctl_spinbench, "A",
+    "Cost of an uncontended NDIS spinlock pair, before and after");
+
 #ifdef __i386__
 void
 KefAcquireSpinLockAtDpcLevel(unsigned long *lock)
 {
-	while (atomic_cmpset_acq_int((volatile unsigned int *)lock, 0, 1) == 0)
-		/* sit and spin */;
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN);
-	thread_unlock(curthread);
+	ntoskrnl_spin_lock(lock);
 }
 
 void
 KefReleaseSpinLockFromDpcLevel(unsigned long *lock)
 {
-	atomic_store_rel_int((volatile unsigned int *)lock, 0);
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN + 20);
-	thread_unlock(curthread);
+	ntoskrnl_spin_unlock(lock);
 }
 
 uint8_t
@@ -2078,58 +2477,107 @@ KeAcquireSpinLockRaiseToDpc(unsigned long *lock)
 void
 KeAcquireSpinLockAtDpcLevel(unsigned long *lock)
 {
-	while (atomic_cmpset_acq_int((volatile unsigned int *)lock, 0, 1) == 0)
-		/* sit and spin */;
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN);
-	thread_unlock(curthread);
+	ntoskrnl_spin_lock(lock);
 }
 
 void
 KeReleaseSpinLockFromDpcLevel(unsigned long *lock)
 {
-	atomic_store_rel_int((volatile unsigned int *)lock, 0);
-	thread_lock(curthread);
-	sched_prio(curthread, PRI_MIN_KERN + 20);
-	thread_unlock(curthread);
+	ntoskrnl_spin_unlock(lock);
 }
 #endif /* __i386__ */
 
-uintptr_t
-InterlockedExchange(volatile uint32_t *dst, uintptr_t val)
+/*
+ * The Interlocked family maps straight onto the machine atomics.
+ * Increment and Decrement return the new value, everything else
+ * the value the target held before the operation.
+ */
+uint32_t
+InterlockedExchange(volatile uint32_t *dst, uint32_t val)
 {
-	uintptr_t r;
-
-	mtx_lock_spin(&nt_interlock);
-	r = *dst;
-	*dst = val;
-	mtx_unlock_spin(&nt_interlock);
-
-	return (r);
+	return (atomic_swap_32(dst, val));
 }
 
 static int32_t
 InterlockedIncrement(volatile int32_t *addend)
 {
-	atomic_add_int(addend, 1);
-
-	return (*addend);
+	return (atomic_fetchadd_32((volatile uint32_t *)addend, 1) + 1);
 }
 
 static int32_t
 InterlockedDecrement(volatile int32_t *addend)
 {
-	atomic_subtract_int(addend, 1);
+	return (atomic_fetchadd_32((volatile uint32_t *)addend, -1) - 1);
+}
 
-	return (*addend);
+static int32_t
+InterlockedExchangeAdd(volatile int32_t *addend, int32_t val)
+{
+	return (atomic_fetchadd_32((volatile uint32_t *)addend, val));
 }
 
-static void
-ExInterlockedAddLargeStatistic(uint64_t *addend, uint32_t inc)
+static int32_t
+InterlockedCompareExchange(volatile int32_t *dst, int32_t val,
+    int32_t cmp)
 {
-	mtx_lock_spin(&nt_interlock);
-	*addend += inc;
-	mtx_unlock_spin(&nt_interlock);
+	int32_t old;
+
+	do {
+		old = *dst;
+		if (old != cmp)
+			return (old);
+	} while (!atomic_cmpset_32((volatile uint32_t *)dst, cmp, val));
+
+	return (cmp);
+}
+
+/*
+ * The Ex variants take a spinlock for CPUs that lack the atomic
+ * instruction the update needs. Windows itself ignores it on every
+ * CPU it still supports; here each update is a single atomic
+ * instruction too, so taking the lock would only add contention.
+ */
+static uint32_t
+ExInterlockedAddUlong(volatile uint32_t *addend, uint32_t inc,
+    unsigned long *lock)
+{
+	return (atomic_fetchadd_32(addend, inc));
+}
+
+/*
+ * On i386 ExInterlockedCompareExchange64() is _fastcall with the
+ * spinlock as a fourth argument, which the wrapper does not pass
+ * through. ExfInterlockedCompareExchange64() is the same call
+ * without the lock, which is what the Windows headers turn the
+ * former into when building for i386.
+ */
+static uint64_t
+ExInterlockedCompareExchange64(volatile uint64_t *dst, uint64_t *val,
+    uint64_t *cmp)
+{
+	uint64_t old;
+
+	do {
+		old = *dst;
+		if (old != *cmp)
+			return (old);
+	} while (!atomic_cmpset_64(dst, *cmp, *val));
+
+	return (*cmp);
+}
+
+void
+ExInterlockedAddLargeStatistic(volatile uint64_t *addend, uint32_t inc)
+{
+#ifdef __amd64__
+	atomic_add_64(addend, inc);
+#else
+	uint64_t old;
+
+	do {
+		old = *addend;
+	} while (!atomic_cmpset_64(addend, old, old + inc));
+#endif
 }
 
 struct mdl *
@@ -3457,21 +3905,32 @@ KeInitializeTimerEx(struct nt_ktimer *timer, enum timer_type type)
  * - On SMP systems, it can be set to run on a specific processor.
  * In order to satisfy the last property, we create a DPC thread for
  * each CPU in the system and bind it to that CPU. Each thread
- * maintains three queues with different importance levels, which
- * will be processed in order from lowest to highest.
+ * maintains three FIFO queues with different importance levels,
+ * drained HIGH, then MEDIUM, then LOW. So that MEDIUM DPCs which keep
+ * requeueing themselves can't starve LOW ones, a LOW DPC gets a turn
+ * after every NT_DPC_LOW_QUOTA MEDIUM ones run while it waits.
  *
  * In Windows, interrupt handlers run as DPCs. (Not to be confused
  * with ISRs, which run in interrupt context and can preempt DPCs.)
  * ISRs are given the highest importance so that they'll take
  * precedence over timers and other things.
+ *
+ * A queued DPC points to its queue through its DpcData field, which
+ * we call lock. It is claimed with a compare-and-swap, which tells
+ * KeInsertQueueDpc() whether it is already queued, possibly on
+ * another CPU, and tells KeRemoveQueueDpc() where to look for it.
  */
+#define	NT_DPC_LOW_QUOTA	32
+
 static void
 ntoskrnl_dpc_thread(void *arg)
 {
 	struct kdpc_queue *kq = arg;
+	struct list_entry *q = kq->disp;
 	struct nt_kdpc *d;
 	struct list_entry *l;
 	uint8_t irql;
+	int medium;
 
 	kq->td = curthread;
 	kq->exit = FALSE;
@@ -3481,6 +3940,7 @@ ntoskrnl_dpc_thread(void *arg)
 	 * once scheduled by an ISR.
 	 */
 	thread_lock(curthread);
+	sched_bind(curthread, kq->cpu);
 	sched_prio(curthread, PRI_MIN_KERN + 20);
 	thread_unlock(curthread);
 
@@ -3494,10 +3954,22 @@ ntoskrnl_dpc_thread(void *arg)
 			break;
 		}
 
-		while (!IsListEmpty(&kq->disp)) {
-			l = RemoveHeadList(&kq->disp);
+		for (medium = 0;;) {
+			if (!IsListEmpty(&q[IMPORTANCE_HIGH]))
+				l = RemoveHeadList(&q[IMPORTANCE_HIGH]);
+			else if (!IsListEmpty(&q[IMPORTANCE_MEDIUM]) &&
+			    (medium < NT_DPC_LOW_QUOTA ||
+			    IsListEmpty(&q[IMPORTANCE_LOW]))) {
+				l = RemoveHeadList(&q[IMPORTANCE_MEDIUM]);
+				medium++;
+			} else if (!IsListEmpty(&q[IMPORTANCE_LOW])) {
+				l = RemoveHeadList(&q[IMPORTANCE_LOW]);
+				medium = 0;
+			} else
+				break;
 			d = CONTAINING_RECORD(l, struct nt_kdpc, dpclistentry);
 			InitializeListHead(&d->dpclistentry);
+			atomic_store_rel_ptr((volatile uintptr_t *)&d->lock, 0);
 			KeReleaseSpinLockFromDpcLevel(&kq->lock);
 			MSCALL4(d->deferedfunc, d, d->deferredctx,
 			    d->sysarg1, d->sysarg2);
@@ -3514,31 +3986,16 @@ ntoskrnl_dpc_thread(void *arg)
 static void
 ntoskrnl_destroy_dpc_thread(void)
 {
-	struct nt_kdpc dpc;
-
-	kq_queue->exit = TRUE;
-	KeInitializeDpc(&dpc, NULL, NULL);
-	KeSetTargetProcessorDpc(&dpc, 0);
-	KeInsertQueueDpc(&dpc, NULL, NULL);
-	while (kq_queue->exit)
-		tsleep(kq_queue->td->td_proc, PWAIT, "dpcw", hz/10);
-}
-
-static uint8_t
-ntoskrnl_insert_dpc(struct list_entry *head, struct nt_kdpc *dpc)
-{
-	struct list_entry *l;
-
-	for (l = head->flink; l != head; l = l->flink)
-		if (CONTAINING_RECORD(l, struct nt_kdpc, dpclistentry) == dpc)
-			return (FALSE);
-
-	if (dpc->importance == IMPORTANCE_LOW)
-		InsertTailList(head, &dpc->dpclistentry);
-	else
-		InsertHeadList(head, &dpc->dpclistentry);
+	struct kdpc_queue *kq;
+	int i;
 
-	return (TRUE);
+	CPU_FOREACH(i) {
+		kq = &kq_queues[i];
+		kq->exit = TRUE;
+		KeSetEvent(&kq->proc, IO_NO_INCREMENT, FALSE);
+		while (kq->exit)
+			tsleep(kq->td->td_proc, PWAIT, "dpcw", hz/10);
+	}
 }
 
 void
@@ -3551,29 +4008,47 @@ KeInitializeDpc(struct nt_kdpc *dpc, void *dpcfunc, void *dpcctx)
 	dpc->deferredctx = dpcctx;
 	dpc->num = KDPC_CPU_DEFAULT;
 	dpc->importance = IMPORTANCE_MEDIUM;
+	dpc->lock = NULL;
 	InitializeListHead(&dpc->dpclistentry);
 }
 
+/*
+ * Queue the DPC on the CPU it was targeted at with
+ * KeSetTargetProcessorDpc(), or on the current one.
+ */
 uint8_t
 KeInsertQueueDpc(struct nt_kdpc *dpc, void *sysarg1, void *sysarg2)
 {
+	struct kdpc_queue *kq;
 	uint8_t r;
 	uint8_t irql;
 
 	KASSERT(dpc != NULL, ("no dpc"));
 
-	KeAcquireSpinLock(&kq_queue->lock, &irql);
-	r = ntoskrnl_insert_dpc(&kq_queue->disp, dpc);
+	if (dpc->num == KDPC_CPU_DEFAULT)
+		kq = &kq_queues[KeGetCurrentProcessorNumber()];
+	else
+		kq = &kq_queues[dpc->num];
+
+	/*
+	 * Claim the DPC while holding the queue lock, so that
+	 * KeRemoveQueueDpc() never sees it claimed but not yet linked.
+	 */
+	KeAcquireSpinLock(&kq->lock, &irql);
+	r = atomic_cmpset_ptr((volatile uintptr_t *)&dpc->lock, 0,
+	    (uintptr_t)kq) ? TRUE : FALSE;
 	if (r == TRUE) {
 		dpc->sysarg1 = sysarg1;
 		dpc->sysarg2 = sysarg2;
+		InsertTailList(&kq->disp[dpc->importance],
+		    &dpc->dpclistentry);
 	}
-	KeReleaseSpinLock(&kq_queue->lock, irql);
+	KeReleaseSpinLock(&kq->lock, irql);
 
 	if (r == FALSE)
 		return (r);
 
-	KeSetEvent(&kq_queue->proc, IO_NO_INCREMENT, FALSE);
+	KeSetEvent(&kq->proc, IO_NO_INCREMENT, FALSE);
 
 	return (r);
 }
@@ -3581,20 +4056,26 @@ KeInsertQueueDpc(struct nt_kdpc *dpc, void *sysarg1, void *sysarg2)
 uint8_t
 KeRemoveQueueDpc(struct nt_kdpc *dpc)
 {
-	struct kdpc_queue *kq = kq_queue;
+	struct kdpc_queue *kq;
 	uint8_t irql;
 
 	if (dpc == NULL)
 		return (FALSE);
 
-	KeAcquireSpinLock(&kq->lock, &irql);
-	if (dpc->dpclistentry.flink == &dpc->dpclistentry) {
+	/* The DPC may move to another queue until we hold its lock. */
+	for (;;) {
+		kq = dpc->lock;
+		if (kq == NULL)
+			return (FALSE);
+		KeAcquireSpinLock(&kq->lock, &irql);
+		if (dpc->lock == kq)
+			break;
 		KeReleaseSpinLock(&kq->lock, irql);
-		return (FALSE);
 	}
 
 	RemoveEntryList(&dpc->dpclistentry);
 	InitializeListHead(&dpc->dpclistentry);
+	atomic_store_rel_ptr((volatile uintptr_t *)&dpc->lock, 0);
 
 	KeReleaseSpinLock(&kq->lock, irql);
 
@@ -3604,13 +4085,16 @@ KeRemoveQueueDpc(struct nt_kdpc *dpc)
 void
 KeSetImportanceDpc(struct nt_kdpc *dpc, enum kdpc_importance imp)
 {
+	if (imp > IMPORTANCE_HIGH)
+		return;
+
 	dpc->importance = imp;
 }
 
 void
 KeSetTargetProcessorDpc(struct nt_kdpc *dpc, uint8_t cpu)
 {
-	if (cpu > mp_ncpus)
+	if (cpu > mp_maxid || CPU_ABSENT(cpu))
 		return;
 
 	dpc->num = cpu;
@@ -3625,6 +4109,8 @@ void
 flush_queue(void)
 {
 	struct task t_item;
+	int i;
+
 	bzero(&t_item, sizeof(struct task));
 	t_item.ta_func = (task_fn_t *)do_nothing_task;
 	t_item.ta_context = NULL;
@@ -3632,8 +4118,10 @@ flush_queue(void)
 	taskqueue_drain(wq_queue, &t_item);
 	taskqueue_enqueue(nq_queue, &t_item);
 	taskqueue_drain(nq_queue, &t_item);
-	KeSetEvent(&kq_queue->proc, IO_NO_INCREMENT, FALSE);
-	KeWaitForSingleObject(&kq_queue->done, 0, 0, TRUE, NULL);
+	CPU_FOREACH(i) {
+		KeSetEvent(&kq_queues[i].proc, IO_NO_INCREMENT, FALSE);
+		KeWaitForSingleObject(&kq_queues[i].done, 0, 0, TRUE, NULL);
+	}
 }
 
 static uint32_t
@@ -3855,11 +4343,14 @@ struct image_patch_table ntoskrnl_functbl[] = {
 	IMPORT_CFUNC_MAP(toupper, ntoskrnl_toupper, 0),
 	IMPORT_CFUNC_MAP(vsprintf, vsprintf_wrap, 0),
 	IMPORT_FFUNC(ExInterlockedAddLargeStatistic, 2),
+	IMPORT_FFUNC(ExInterlockedCompareExchange64, 4),
 	IMPORT_FFUNC(ExInterlockedPopEntrySList, 2),
 	IMPORT_FFUNC(ExInterlockedPushEntrySList, 3),
 	IMPORT_FFUNC(InitializeSListHead, 1),
+	IMPORT_FFUNC(InterlockedCompareExchange, 3),
 	IMPORT_FFUNC(InterlockedDecrement, 1),
 	IMPORT_FFUNC(InterlockedExchange, 2),
+	IMPORT_FFUNC(InterlockedExchangeAdd, 2),
 	IMPORT_FFUNC(InterlockedIncrement, 1),
 	IMPORT_FFUNC(InterlockedPopEntrySList, 1),
 	IMPORT_FFUNC(InterlockedPushEntrySList, 2),
@@ -3883,6 +4374,9 @@ struct image_patch_table ntoskrnl_functbl[] = {
 	IMPORT_SFUNC(KeReleaseSpinLockFromDpcLevel, 1),
 	IMPORT_SFUNC_MAP(KeAcquireSpinLockRaiseToDpc, KfAcquireSpinLock, 1),
 #endif /* __amd64__*/
+	IMPORT_FFUNC_MAP(ExfInterlockedAddUlong, ExInterlockedAddUlong, 3),
+	IMPORT_FFUNC_MAP(ExfInterlockedCompareExchange64,
+	    ExInterlockedCompareExchange64, 3),
 	IMPORT_FFUNC_MAP(ExpInterlockedPopEntrySList,
 	    InterlockedPopEntrySList, 1),
 	IMPORT_FFUNC_MAP(ExpInterlockedPushEntrySList,
@@ -3897,6 +4391,7 @@ struct image_patch_table ntoskrnl_functbl[] = {
 	IMPORT_SFUNC(ExFreePool, 1),
 	IMPORT_SFUNC(ExFreePoolWithTag, 2),
 	IMPORT_SFUNC(ExInitializeNPagedLookasideList, 7),
+	IMPORT_SFUNC(ExInterlockedAddUlong, 3),
 	IMPORT_SFUNC(ExQueryDepthSList, 1),
 	IMPORT_SFUNC(IoAcquireCancelSpinLock, 1),
 	IMPORT_SFUNC(IoAllocateDriverObjectExtension, 4),
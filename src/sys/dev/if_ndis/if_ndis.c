@@ -37,6 +37,7 @@
 __FBSDID("$FreeBSD$");
 
 //#include "opt_ndis.h"
+#include "opt_device_polling.h"
 #include "opt_wlan.h"
 
 #include <sys/param.h>
@@ -44,11 +45,19 @@ __FBSDID("$FreeBSD$");
 #include <sys/mbuf.h>
 #include <sys/malloc.h>
 #include <sys/sockio.h>
+#include <sys/buf_ring.h>
 #include <sys/bus.h>
+#include <sys/counter.h>
+#include <sys/cpuset.h>
+#include <sys/hash.h>
 #include <sys/kernel.h>
 #include <sys/socket.h>
 #include <sys/module.h>
 #include <sys/priv.h>
+#include <sys/sbuf.h>
+#include <sys/smp.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 
 #include <net/bpf.h>
 #include <net/if.h>
@@ -57,10 +66,18 @@ __FBSDID("$FreeBSD$");
 #include <net/if_dl.h>
 #include <net/if_media.h>
 #include <net/if_types.h>
+#include <net/netisr.h>
+#include <net/vnet.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp_lro.h>
 
 #include <machine/bus.h>
 #include <machine/resource.h>
 
+#include <dev/pci/pcivar.h>
 #include <dev/usb/usb.h>
 #include <dev/usb/usbdi.h>
 
@@ -86,6 +103,19 @@ static const uint16_t dBm2mW[] = {
 	1000
 };
 
+/*
+ * Software RSS input worker: a private RX queue in the same format as
+ * ndis_rxhead, drained by a taskqueue thread bound to one CPU, with an
+ * LRO context of its own.
+ */
+struct ndis_rxworker {
+	struct mbuf * volatile	rw_head;
+	struct ndis_softc	*rw_sc;
+	struct taskqueue	*rw_tq;
+	struct task		rw_task;
+	struct lro_ctrl		rw_lro;
+} __aligned(CACHE_LINE_SIZE);
+
 MODULE_DEPEND(ndis, ether, 1, 1, 1);
 MODULE_DEPEND(ndis, wlan, 1, 1, 1);
 MODULE_DEPEND(ndis, ndisapi, 3, 3, 3);
@@ -141,6 +171,28 @@ static void	ndis_init(void *);
 static int	ndis_ioctl(struct ifnet *, u_long, caddr_t);
 static int	ndis_ioctl_80211(struct ifnet *, u_long, caddr_t);
 static void	ndis_inputtask(struct device_object *, void *);
+#ifdef DEVICE_POLLING
+static int	ndis_poll(struct ifnet *, enum poll_cmd, int);
+static int	ndis_setpolling(struct ndis_softc *, int);
+#endif
+static void	ndis_intr_count(struct ndis_softc *, u_int);
+static void	ndis_rxdirect(struct ndis_softc *, struct mbuf *);
+static void	ndis_rxlat_stamp(struct ndis_softc *, struct mbuf *);
+static void	ndis_rxlat_record(struct ndis_softc *, struct mbuf *, int);
+static int	ndis_sysctl_rxlat(SYSCTL_HANDLER_ARGS);
+static void	ndis_rxqueue_push(struct ndis_softc *, struct mbuf *,
+		    struct mbuf *);
+static struct mbuf *ndis_rxbatch_order(struct mbuf *);
+static int	ndis_rxloan_get(struct ndis_softc *);
+static int	ndis_rxloans_drain(struct ndis_softc *);
+static void	ndis_rxdeliver(struct ndis_softc *, struct mbuf *,
+		    struct lro_ctrl *);
+static uint32_t	ndis_rxhash(struct mbuf *);
+static void	ndis_rxflow(struct ndis_softc *, struct mbuf *);
+static int	ndis_rxworkers_init(struct ndis_softc *);
+static void	ndis_rxworkers_free(struct ndis_softc *);
+static void	ndis_rxworkers_push(struct ndis_softc *, struct mbuf *);
+static void	ndis_rxworker_task(void *, int);
 static int	ndis_key_set(struct ieee80211vap *,
 		    const struct ieee80211_key *, const u_int8_t []);
 static int	ndis_key_delete(struct ieee80211vap *,
@@ -154,6 +206,7 @@ static int	ndis_newstate(struct ieee80211vap *, enum ieee80211_state, int);
 static int	ndis_get_physical_medium(struct ndis_softc *,
 		    enum ndis_physical_medium *);
 static int	ndis_probe_task_offload(struct ndis_softc *);
+static int	ndis_rxcsum_enabled(struct ifnet *, struct mbuf *);
 static int	ndis_raw_xmit(struct ieee80211_node *, struct mbuf *,
 		    const struct ieee80211_bpf_params *);
 static void	ndis_resettask(struct device_object *, void *);
@@ -181,11 +234,17 @@ static void	ndis_set_ssid(struct ndis_softc *, uint8_t *, uint8_t);
 static int	ndis_set_txpower(struct ndis_softc *);
 static void	ndis_set_wol(struct ndis_softc *);
 static int	ndis_set_wpa(struct ndis_softc *, void *, int);
+static void	ndis_sysctl_setup(struct ndis_softc *);
 static void	ndis_setstate_80211(struct ndis_softc *, struct ieee80211vap *);
 static void	ndis_start(struct ifnet *);
+static int	ndis_transmit(struct ifnet *, struct mbuf *);
+static void	ndis_qflush(struct ifnet *);
+static struct mbuf *ndis_txpeek(struct ndis_softc *, struct buf_ring **);
 static void	ndis_starttask(struct device_object *, void *);
 static void	ndis_stop(struct ndis_softc *);
 static void	ndis_tick(void *);
+static void	ndis_txeof_reap(struct ndis_softc *);
+static int	ndis_txbounce_want(struct ndis_softc *, struct mbuf *);
 static void	ndis_ticktask(struct device_object *, void *);
 static void	ndis_update_mcast(struct ieee80211com *);
 static void	ndis_update_promisc(struct ieee80211com *);
@@ -410,17 +469,21 @@ ndis_set_task_offload(struct ndis_softc *sc)
 	struct ndis_task_offload *nto;
 	struct ndis_task_offload_header *ntoh;
 	struct ndis_task_tcpip_csum *nttc;
+	struct ndis_task_tcp_largesend *ntls;
 	int error;
 	uint32_t len;
 
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
 
-	if (sc->ndis_hwassist == 0)
+	if ((ifp->if_capabilities & (IFCAP_HWCSUM | IFCAP_HWCSUM_IPV6)) == 0)
 		return (0);
 
 	len = sizeof(struct ndis_task_offload_header) +
 	    sizeof(struct ndis_task_offload) +
 	    sizeof(struct ndis_task_tcpip_csum);
+	if (ifp->if_capenable & IFCAP_TSO4)
+		len += sizeof(struct ndis_task_offload) +
+		    sizeof(struct ndis_task_tcp_largesend);
 
 	ntoh = malloc(len, M_NDIS_DEV, M_NOWAIT|M_ZERO);
 	if (ntoh == NULL)
@@ -449,6 +512,29 @@ ndis_set_task_offload(struct ndis_softc *sc)
 	if (ifp->if_capenable & IFCAP_RXCSUM)
 		nttc->v4rx = sc->ndis_v4rx;
 
+	if (ifp->if_capenable & IFCAP_TXCSUM_IPV6)
+		nttc->v6tx = sc->ndis_v6tx;
+
+	if (ifp->if_capenable & IFCAP_RXCSUM_IPV6)
+		nttc->v6rx = sc->ndis_v6rx;
+
+	if (ifp->if_capenable & IFCAP_TSO4) {
+		nto->offset_next_task = sizeof(struct ndis_task_offload) +
+		    nto->task_buffer_length;
+		nto = (struct ndis_task_offload *)((char *)nto +
+		    nto->offset_next_task);
+		nto->version = NDIS_TASK_OFFLOAD_VERSION;
+		nto->size = sizeof(struct ndis_task_offload);
+		nto->task = NDIS_TASK_TCP_LARGESEND;
+		nto->offset_next_task = 0;
+		nto->task_buffer_length =
+		    sizeof(struct ndis_task_tcp_largesend);
+
+		ntls = (struct ndis_task_tcp_largesend *)nto->task_buffer;
+		*ntls = sc->ndis_lso;
+		ntls->version = NDIS_TASK_TCP_LARGESEND_V0;
+	}
+
 	error = ndis_set(sc, OID_TCP_TASK_OFFLOAD, ntoh, len);
 	free(ntoh, M_NDIS_DEV);
 	return (error);
@@ -461,6 +547,7 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	struct ndis_task_offload *nto;
 	struct ndis_task_offload_header *ntoh;
 	struct ndis_task_tcpip_csum *nttc = NULL;
+	struct ndis_task_tcp_largesend *ntls = NULL;
 	int error;
 
 	ntoh = malloc(256, M_NDIS_DEV, M_NOWAIT|M_ZERO);
@@ -474,7 +561,7 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	ntoh->encapsulation_format.encapsulation = NDIS_ENCAP_IEEE802_3;
 	ntoh->encapsulation_format.flags = NDIS_ENCAPFLAG_FIXEDHDRLEN;
 
-	error = ndis_get(sc, OID_TCP_TASK_OFFLOAD, ntoh, sizeof(ntoh));
+	error = ndis_get(sc, OID_TCP_TASK_OFFLOAD, ntoh, 256);
 	if (error) {
 		free(ntoh, M_NDIS_DEV);
 		return (error);
@@ -492,9 +579,12 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 		case NDIS_TASK_TCPIP_CSUM:
 			nttc = (struct ndis_task_tcpip_csum *)nto->task_buffer;
 			break;
+		case NDIS_TASK_TCP_LARGESEND:
+			ntls = (struct ndis_task_tcp_largesend *)
+			    nto->task_buffer;
+			break;
 		/* Don't handle these yet. */
 		case NDIS_TASK_IPSEC:
-		case NDIS_TASK_TCP_LARGESEND:
 		default:
 			break;
 		}
@@ -518,7 +608,7 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 		sc->ndis_hwassist |= CSUM_TCP;
 	if (nttc->v4tx & NDIS_TCPSUM_FLAGS_UDP_CSUM)
 		sc->ndis_hwassist |= CSUM_UDP;
-	if (sc->ndis_hwassist)
+	if (sc->ndis_hwassist & (CSUM_IP | CSUM_TCP | CSUM_UDP))
 		ifp->if_capabilities |= IFCAP_TXCSUM;
 	if (nttc->v4rx & NDIS_TCPSUM_FLAGS_IP_CSUM)
 		ifp->if_capabilities |= IFCAP_RXCSUM;
@@ -527,6 +617,40 @@ ndis_probe_task_offload(struct ndis_softc *sc)
 	if (nttc->v4rx & NDIS_TCPSUM_FLAGS_UDP_CSUM)
 		ifp->if_capabilities |= IFCAP_RXCSUM;
 
+	/* IPv6 has no header checksum, only TCP and UDP matter. */
+	sc->ndis_v6tx = nttc->v6tx;
+	sc->ndis_v6rx = nttc->v6rx;
+
+	if (nttc->v6tx & NDIS_TCPSUM_FLAGS_TCP_CSUM)
+		sc->ndis_hwassist |= CSUM_TCP_IPV6;
+	if (nttc->v6tx & NDIS_TCPSUM_FLAGS_UDP_CSUM)
+		sc->ndis_hwassist |= CSUM_UDP_IPV6;
+	if (sc->ndis_hwassist & (CSUM_TCP_IPV6 | CSUM_UDP_IPV6))
+		ifp->if_capabilities |= IFCAP_TXCSUM_IPV6;
+	if (nttc->v6rx &
+	    (NDIS_TCPSUM_FLAGS_TCP_CSUM | NDIS_TCPSUM_FLAGS_UDP_CSUM))
+		ifp->if_capabilities |= IFCAP_RXCSUM_IPV6;
+
+	/*
+	 * Our TCP hands down TSO frames carrying timestamps as soon as
+	 * they span two segments, so only use large send offload if the
+	 * miniport copes with both.
+	 */
+	if (ntls != NULL && (sc->ndis_hwassist & CSUM_TCP) &&
+	    ntls->tcpopt && ntls->minsegcnt <= 2 &&
+	    ntls->maxofflen >= IP_MAXPACKET / 8 + ETHER_HDR_LEN +
+	    ETHER_VLAN_ENCAP_LEN) {
+		sc->ndis_lso = *ntls;
+		sc->ndis_hwassist |= CSUM_TSO;
+		ifp->if_capabilities |= IFCAP_TSO4;
+		ifp->if_hw_tsomax = min(ntls->maxofflen, IP_MAXPACKET) -
+		    (ETHER_HDR_LEN + ETHER_VLAN_ENCAP_LEN);
+		if (sc->ndis_sc) {
+			ifp->if_hw_tsomaxsegcount = NDIS_MAXSEG;
+			ifp->if_hw_tsomaxsegsize = MCLBYTES;
+		}
+	}
+
 	free(ntoh, M_NDIS_DEV);
 	return (0);
 }
@@ -571,6 +695,107 @@ ndis_auth_mode(uint32_t type)
 	return (IEEE80211_AUTH_NONE);
 }
 
+/*
+ * Set up the per-device knobs and statistics that belong to the
+ * wrapper itself, as opposed to the registry keys of the Windows
+ * driver created by ndis_create_sysctls().
+ */
+static void
+ndis_sysctl_setup(struct ndis_softc *sc)
+{
+	struct sysctl_ctx_list *ctx;
+	struct sysctl_oid_list *child;
+	int i;
+
+	ctx = device_get_sysctl_ctx(sc->ndis_dev);
+	child = SYSCTL_CHILDREN(device_get_sysctl_tree(sc->ndis_dev));
+
+	sc->ndis_rxloans_max = NDIS_RXLOANS_MAX;
+	sc->ndis_rxcopybreak = NDIS_RXCOPYBREAK;
+	sc->ndis_nrxworkers = 1;
+	sc->ndis_rx_copybreak = counter_u64_alloc(M_WAITOK);
+	sc->ndis_rx_copied = counter_u64_alloc(M_WAITOK);
+	sc->ndis_rx_loaned = counter_u64_alloc(M_WAITOK);
+	sc->ndis_txcopy_len = NDIS_TXCOPY_LEN;
+	sc->ndis_txcopy_frags = NDIS_TXCOPY_FRAGS;
+	sc->ndis_tx_copied = counter_u64_alloc(M_WAITOK);
+	sc->ndis_tx_mapped = counter_u64_alloc(M_WAITOK);
+	sc->ndis_tx_tso = counter_u64_alloc(M_WAITOK);
+	sc->ndis_tx_tsobytes = counter_u64_alloc(M_WAITOK);
+	for (i = 0; i < NDIS_RXLAT_BUCKETS; i++) {
+		sc->ndis_rxlat_hist[NDIS_RXLAT_TASK][i] =
+		    counter_u64_alloc(M_WAITOK);
+		sc->ndis_rxlat_hist[NDIS_RXLAT_DIRECT][i] =
+		    counter_u64_alloc(M_WAITOK);
+	}
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_loans_max", CTLFLAG_RWTUN,
+	    &sc->ndis_rxloans_max, 0,
+	    "Max receive packets loaned to the stack before copying");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_loans", CTLFLAG_RD,
+	    __DEVOLATILE(u_int *, &sc->ndis_rxloans), 0,
+	    "Receive packets currently loaned to the stack");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_direct", CTLFLAG_RWTUN,
+	    &sc->ndis_rxdirect, 0,
+	    "Queue received frames to netisr directly from the DPC");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_latency", CTLFLAG_RDTUN,
+	    &sc->ndis_rxlat, 0,
+	    "Record how long received frames take to reach the stack");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rx_latency_task",
+	    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+	    NDIS_RXLAT_TASK, ndis_sysctl_rxlat, "A",
+	    "DPC to if_input() latency through the input task or workers");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rx_latency_direct",
+	    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+	    NDIS_RXLAT_DIRECT, ndis_sysctl_rxlat, "A",
+	    "DPC to netisr_queue() latency with rx_direct");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_workers", CTLFLAG_RDTUN,
+	    &sc->ndis_nrxworkers, 0,
+	    "Per-CPU input workers received flows are spread over");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "rx_copybreak", CTLFLAG_RWTUN,
+	    &sc->ndis_rxcopybreak, 0,
+	    "Receive frames up to this size are copied, not loaned");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "rx_copybreak_pkts",
+	    CTLFLAG_RD, &sc->ndis_rx_copybreak,
+	    "Small receive frames copied into a single mbuf");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "rx_copied_pkts",
+	    CTLFLAG_RD, &sc->ndis_rx_copied,
+	    "Receive frames copied due to driver or loan shortage");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "rx_loaned_pkts",
+	    CTLFLAG_RD, &sc->ndis_rx_loaned,
+	    "Receive frames loaned to the stack without copying");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "tx_copy_len", CTLFLAG_RWTUN,
+	    &sc->ndis_txcopy_len, 0,
+	    "Transmit frames up to this size are copied into bounce buffers");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "tx_copy_frags", CTLFLAG_RWTUN,
+	    &sc->ndis_txcopy_frags, 0,
+	    "Transmit frames with more fragments than this are copied");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "tx_copied_pkts",
+	    CTLFLAG_RD, &sc->ndis_tx_copied,
+	    "Transmit frames copied into pre-mapped bounce buffers");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "tx_mapped_pkts",
+	    CTLFLAG_RD, &sc->ndis_tx_mapped,
+	    "Transmit frames loaded into a DMA map");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "tx_tso_pkts",
+	    CTLFLAG_RD, &sc->ndis_tx_tso,
+	    "Large send frames completed by the miniport");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "tx_tso_bytes",
+	    CTLFLAG_RD, &sc->ndis_tx_tsobytes,
+	    "TCP payload bytes the miniport reported sent by large send");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "poll_budget", CTLFLAG_RWTUN,
+	    &sc->ndis_poll_budget, 0,
+	    "Frames handled with interrupts off before yielding, 0 disables");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "intr_count",
+	    CTLFLAG_RD, &sc->ndis_intrs,
+	    "Interrupts that scheduled the miniport's handler");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "poll_count",
+	    CTLFLAG_RD, &sc->ndis_polls,
+	    "Extra calls of the miniport's handler made by polling");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "poll_pkts",
+	    CTLFLAG_RD, &sc->ndis_poll_pkts,
+	    "Frames received or completed during those polls");
+}
+
 /*
  * Attach the interface. Allocate softc structures, do ifmedia
  * setup and ethernet/BPF attach.
@@ -591,8 +816,8 @@ ndis_attach(device_t dev)
 	sc = device_get_softc(dev);
 	mtx_init(&sc->ndis_mtx, device_get_nameunit(dev), MTX_NETWORK_LOCK,
 	    MTX_DEF);
-	KeInitializeSpinLock(&sc->ndis_rxlock);
 	KeInitializeSpinLock(&sc->ndisusb_tasklock);
+	KeInitializeSpinLock(&sc->ndis_intr_runlock);
 	KeInitializeSpinLock(&sc->ndisusb_xferdonelock);
 	InitializeListHead(&sc->ndis_shlist);
 	InitializeListHead(&sc->ndisusb_tasklist);
@@ -647,6 +872,11 @@ ndis_attach(device_t dev)
 	    IoAllocateWorkItem(sc->ndis_block->deviceobj);
 	KeInitializeDpc(&sc->ndis_rxdpc, ndis_rxeof_xfr_wrap, sc->ndis_block);
 
+	/* The interrupt path counts from the moment the miniport starts. */
+	sc->ndis_intrs = counter_u64_alloc(M_WAITOK);
+	sc->ndis_polls = counter_u64_alloc(M_WAITOK);
+	sc->ndis_poll_pkts = counter_u64_alloc(M_WAITOK);
+
 	if (ndis_init_nic(sc) != NDIS_STATUS_SUCCESS)
 		goto fail;
 
@@ -692,6 +922,8 @@ ndis_attach(device_t dev)
 	if (!NDIS_SERIALIZED(sc->ndis_block))
 		sc->ndis_maxpkts = 64; // FIXME sysctl
 
+	ndis_sysctl_setup(sc);
+
 	sc->ndis_hang_timer = sc->ndis_block->check_for_hang_secs;
 
 	/* Enforce some sanity, just in case. */
@@ -704,6 +936,12 @@ ndis_attach(device_t dev)
 		device_printf(dev, "failed to allocate TX array\n");
 		goto fail;
 	}
+	sc->ndis_txstage = malloc(sizeof(struct ndis_packet *) *
+	    sc->ndis_maxpkts, M_NDIS_DEV, M_NOWAIT|M_ZERO);
+	if (sc->ndis_txstage == NULL) {
+		device_printf(dev, "failed to allocate TX staging array\n");
+		goto fail;
+	}
 
 	/* Allocate a pool of ndis_packets for TX encapsulation. */
 	NdisAllocatePacketPool(&rval, &sc->ndis_txpool, sc->ndis_maxpkts,
@@ -713,6 +951,24 @@ ndis_attach(device_t dev)
 		device_printf(dev, "failed to allocate TX packet pool\n");
 		goto fail;
 	}
+
+	/* Give every TX ring slot its own packet for good. */
+	sc->ndis_txslots = malloc(sizeof(struct ndis_txslot) *
+	    sc->ndis_maxpkts, M_NDIS_DEV, M_NOWAIT|M_ZERO);
+	if (sc->ndis_txslots == NULL) {
+		device_printf(dev, "failed to allocate TX slots\n");
+		goto fail;
+	}
+	for (i = 0; i < sc->ndis_maxpkts; i++) {
+		NdisAllocatePacket(&rval, &sc->ndis_txslots[i].ts_packet,
+		    sc->ndis_txpool);
+		if (rval) {
+			sc->ndis_txslots[i].ts_packet = NULL;
+			device_printf(dev, "failed to allocate TX packet\n");
+			goto fail;
+		}
+		sc->ndis_txslots[i].ts_packet->txidx = i;
+	}
 	sc->ndis_txpending = sc->ndis_maxpkts;
 
 	/* If the NDIS module requested scatter/gather, init maps. */
@@ -752,13 +1008,52 @@ ndis_attach(device_t dev)
 	if_initname(ifp, device_get_name(dev), device_get_unit(dev));
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST;
 	ifp->if_start = ndis_start;
+	if (!NDIS_SERIALIZED(sc->ndis_block) && !NDIS_80211(sc)) {
+		sc->ndis_txbr = malloc(sizeof(struct buf_ring *) *
+		    (mp_maxid + 1), M_NDIS_DEV, M_NOWAIT|M_ZERO);
+		if (sc->ndis_txbr == NULL) {
+			device_printf(dev, "failed to allocate TX rings\n");
+			goto fail;
+		}
+		for (i = 0; i <= mp_maxid; i++) {
+			sc->ndis_txbr[i] = buf_ring_alloc(NDIS_TXBR_SIZE,
+			    M_NDIS_DEV, M_NOWAIT, &sc->ndis_mtx);
+			if (sc->ndis_txbr[i] == NULL) {
+				device_printf(dev,
+				    "failed to allocate TX rings\n");
+				goto fail;
+			}
+		}
+		ifp->if_transmit = ndis_transmit;
+		ifp->if_qflush = ndis_qflush;
+	}
 	ifp->if_init = ndis_init;
 	ifp->if_baudrate = 10000000;
 	IFQ_SET_MAXLEN(&ifp->if_snd, ifqmaxlen);
 	ifp->if_snd.ifq_drv_maxlen = ifqmaxlen;
 	IFQ_SET_READY(&ifp->if_snd);
+
+	/* Software LRO relies on the miniport verifying TCP checksums. */
+	if (!NDIS_80211(sc) &&
+	    ifp->if_capabilities & (IFCAP_RXCSUM | IFCAP_RXCSUM_IPV6)) {
+		sc->ndis_lro = malloc(sizeof(struct lro_ctrl), M_NDIS_DEV,
+		    M_NOWAIT|M_ZERO);
+		if (sc->ndis_lro != NULL && tcp_lro_init(sc->ndis_lro) == 0) {
+			sc->ndis_lro->ifp = ifp;
+			ifp->if_capabilities |= IFCAP_LRO;
+		}
+	}
+	if (!NDIS_80211(sc) && ndis_rxworkers_init(sc)) {
+		device_printf(dev, "failed to start RX workers\n");
+		goto fail;
+	}
 	ifp->if_capenable = ifp->if_capabilities;
 	ifp->if_hwassist = sc->ndis_hwassist;
+#ifdef DEVICE_POLLING
+	/* Polling is opt-in, so it isn't in if_capenable by default. */
+	if (!NDIS_80211(sc) && sc->ndis_bus_type != NDIS_PNPBUS)
+		ifp->if_capabilities |= IFCAP_POLLING;
+#endif
 
 	rval = ndis_get(sc, OID_PNP_CAPABILITIES, &pnp, sizeof(pnp));
 	if (!rval) {
@@ -1053,6 +1348,33 @@ ndis_vap_delete(struct ieee80211vap *vap)
 	free(nvp, M_80211_VAP);
 }
 
+/*
+ * Receive buffers loaned to the stack belong to the miniport, which
+ * frees them when it is halted, so detach has to get all of them back
+ * first. New frames are copied by then; a loaned mbuf may still sit on
+ * a socket nobody reads though, so give up after NDIS_RXLOANS_WAIT
+ * seconds rather than hang the detach.
+ */
+static int
+ndis_rxloans_drain(struct ndis_softc *sc)
+{
+	int i;
+
+	atomic_store_rel_int(&sc->ndis_rxnoloan, 1);
+	atomic_thread_fence_seq_cst();
+	for (i = 0; atomic_load_acq_int(&sc->ndis_rxloans) != 0; i++) {
+		if (i == NDIS_RXLOANS_WAIT * 10) {
+			device_printf(sc->ndis_dev,
+			    "%u receive buffers still loaned to the stack\n",
+			    sc->ndis_rxloans);
+			atomic_store_rel_int(&sc->ndis_rxnoloan, 0);
+			return (EBUSY);
+		}
+		pause("ndisrx", hz / 10);
+	}
+	return (0);
+}
+
 /*
  * Shutdown hardware and free up resources. This can be called any
  * time after the mutex has been initialized. It is called in both
@@ -1064,24 +1386,37 @@ int
 ndis_detach(device_t dev)
 {
 	struct ndis_softc *sc;
+	struct ndis_txslot *ts;
+	struct mbuf *m;
+	int i;
 
 	sc = device_get_softc(dev);
 	if (device_is_attached(dev)) {
 		if (sc->ndis_ifp != NULL) {
+#ifdef DEVICE_POLLING
+			if (sc->ndis_polling)
+				ndis_setpolling(sc, 0);
+#endif
 			ndis_stop(sc);
+			if (ndis_rxloans_drain(sc) != 0)
+				return (EBUSY);
 			if (NDIS_80211(sc))
 				ieee80211_ifdetach(sc->ndis_ifp->if_l2com);
 			else
 				ether_ifdetach(sc->ndis_ifp);
 		}
 	}
-	if (NDIS_INITIALIZED(sc))
+	if (NDIS_INITIALIZED(sc)) {
 		ndis_halt_nic(sc);
+		/* The miniport may have completed sends while halting. */
+		ndis_txeof_reap(sc);
+	}
 
 	IoFreeWorkItem(sc->ndis_tickitem);
 	IoFreeWorkItem(sc->ndis_startitem);
 	IoFreeWorkItem(sc->ndis_resetitem);
 	IoFreeWorkItem(sc->ndis_inputitem);
+	ndis_rxworkers_free(sc);
 	IoFreeWorkItem(sc->ndisusb_xferdoneitem);
 	IoFreeWorkItem(sc->ndisusb_taskitem);
 
@@ -1089,7 +1424,10 @@ ndis_detach(device_t dev)
 	bus_generic_detach(dev);
 
 	if (sc->ndis_irq != NULL)
-		bus_release_resource(dev, SYS_RES_IRQ, 0, sc->ndis_irq);
+		bus_release_resource(dev, SYS_RES_IRQ, sc->ndis_irq_rid,
+		    sc->ndis_irq);
+	if (sc->ndis_msi)
+		pci_release_msi(dev);
 	if (sc->ndis_res_io != NULL)
 		bus_release_resource(dev, SYS_RES_IOPORT,
 		    sc->ndis_io_rid, sc->ndis_res_io);
@@ -1107,10 +1445,67 @@ ndis_detach(device_t dev)
 		ndis_destroy_dma(sc);
 	if (sc->ndis_txarray != NULL)
 		free(sc->ndis_txarray, M_NDIS_DEV);
+	if (sc->ndis_txstage != NULL)
+		free(sc->ndis_txstage, M_NDIS_DEV);
+	if (sc->ndis_rx_copybreak != NULL)
+		counter_u64_free(sc->ndis_rx_copybreak);
+	if (sc->ndis_rx_copied != NULL)
+		counter_u64_free(sc->ndis_rx_copied);
+	if (sc->ndis_rx_loaned != NULL)
+		counter_u64_free(sc->ndis_rx_loaned);
+	if (sc->ndis_tx_copied != NULL)
+		counter_u64_free(sc->ndis_tx_copied);
+	if (sc->ndis_tx_mapped != NULL)
+		counter_u64_free(sc->ndis_tx_mapped);
+	if (sc->ndis_tx_tso != NULL)
+		counter_u64_free(sc->ndis_tx_tso);
+	if (sc->ndis_tx_tsobytes != NULL)
+		counter_u64_free(sc->ndis_tx_tsobytes);
+	for (i = 0; i < NDIS_RXLAT_BUCKETS; i++) {
+		if (sc->ndis_rxlat_hist[NDIS_RXLAT_TASK][i] != NULL)
+			counter_u64_free(
+			    sc->ndis_rxlat_hist[NDIS_RXLAT_TASK][i]);
+		if (sc->ndis_rxlat_hist[NDIS_RXLAT_DIRECT][i] != NULL)
+			counter_u64_free(
+			    sc->ndis_rxlat_hist[NDIS_RXLAT_DIRECT][i]);
+	}
+	if (sc->ndis_intrs != NULL)
+		counter_u64_free(sc->ndis_intrs);
+	if (sc->ndis_polls != NULL)
+		counter_u64_free(sc->ndis_polls);
+	if (sc->ndis_poll_pkts != NULL)
+		counter_u64_free(sc->ndis_poll_pkts);
+	if (sc->ndis_lro != NULL) {
+		if (sc->ndis_lro->ifp != NULL)
+			tcp_lro_free(sc->ndis_lro);
+		free(sc->ndis_lro, M_NDIS_DEV);
+	}
 	if (!NDIS_80211(sc))
 		ifmedia_removeall(&sc->ifmedia);
+	if (sc->ndis_txslots != NULL) {
+		for (i = 0; i < sc->ndis_maxpkts; i++) {
+			ts = &sc->ndis_txslots[i];
+			if (ts->ts_packet == NULL)
+				continue;
+			ndis_mtop_release(ts->ts_packet, ts->ts_mdl,
+			    NDIS_TXSLOT_MDLS);
+			NdisFreePacket(ts->ts_packet);
+		}
+		free(sc->ndis_txslots, M_NDIS_DEV);
+	}
 	if (sc->ndis_txpool != NULL)
 		NdisFreePacketPool(sc->ndis_txpool);
+	if (sc->ndis_txbr != NULL) {
+		for (i = 0; i <= mp_maxid; i++) {
+			if (sc->ndis_txbr[i] == NULL)
+				continue;
+			while ((m = buf_ring_dequeue_sc(sc->ndis_txbr[i])) !=
+			    NULL)
+				m_freem(m);
+			buf_ring_free(sc->ndis_txbr[i], M_NDIS_DEV);
+		}
+		free(sc->ndis_txbr, M_NDIS_DEV);
+	}
 	if (sc->ndis_bus_type == NDIS_PCIBUS) {
 		windrv_destroy_pdo(windrv_lookup(0, "PCI Bus"), dev);
 		bus_dma_tag_destroy(sc->ndis_parent_tag);
@@ -1161,11 +1556,15 @@ NdisMEthIndicateReceive(struct ndis_miniport_block *block, void *ctx,
 {
 	uint8_t irql = 0;
 	uint32_t status;
+	struct ndis_softc *sc;
 	struct mdl *b;
 	struct ndis_packet *p;
 	struct mbuf *m;
 	struct ndis_ethpriv *priv;
 
+	sc = device_get_softc(block->physdeviceobj->devext);
+	ndis_intr_count(sc, 1);
+
 	m = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
 	if (m == NULL)
 		return;
@@ -1231,7 +1630,7 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 	int32_t status;
 	struct ndis_ethpriv *priv;
 	struct ifnet *ifp;
-	struct mbuf *m;
+	struct mbuf *m, *head = NULL, *tail = NULL;
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
@@ -1265,12 +1664,8 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 		if (status == NDIS_STATUS_SUCCESS) {
 			IoFreeMdl(p->private.head);
 			NdisFreePacket(p);
-			KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-			_IF_ENQUEUE(&sc->ndis_rxqueue, m);
-			KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-			IoQueueWorkItem(sc->ndis_inputitem,
-			    (io_workitem_func)ndis_inputtask_wrap,
-			    CRITICAL, ifp);
+			ndis_rxflow(sc, m);
+			NDIS_RXBATCH_ADD(head, tail, m);
 		}
 
 		if (status == NDIS_STATUS_FAILURE)
@@ -1278,6 +1673,9 @@ ndis_rxeof_xfr(struct nt_kdpc *dpc, struct ndis_miniport_block *block,
 	}
 
 	KeReleaseSpinLockFromDpcLevel(&block->lock);
+
+	if (head != NULL)
+		ndis_rxqueue_push(sc, head, tail);
 }
 
 static void
@@ -1303,11 +1701,47 @@ NdisMTransferDataComplete(struct ndis_miniport_block *block,
 
 	m->m_len = m->m_pkthdr.len;
 	m->m_pkthdr.rcvif = ifp;
-	KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-	_IF_ENQUEUE(&sc->ndis_rxqueue, m);
-	KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-	IoQueueWorkItem(sc->ndis_inputitem,
-	    (io_workitem_func)ndis_inputtask_wrap, CRITICAL, ifp);
+	m->m_nextpkt = NULL;
+	ndis_rxflow(sc, m);
+	ndis_rxqueue_push(sc, m, m);
+}
+
+/*
+ * Take a loan slot unless the limit is reached or ndis_rxloans_drain()
+ * has stopped loaning. The count goes up before the flag is checked,
+ * and the other way round there, so one of the two always sees the
+ * other's store.
+ */
+static int
+ndis_rxloan_get(struct ndis_softc *sc)
+{
+
+	if (sc->ndis_rxloans >= sc->ndis_rxloans_max)
+		return (0);
+	atomic_add_int(&sc->ndis_rxloans, 1);
+	atomic_thread_fence_seq_cst();
+	if (sc->ndis_rxnoloan) {
+		atomic_subtract_rel_int(&sc->ndis_rxloans, 1);
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * The checksum verdicts of a received packet don't say which IP version
+ * they are for, so go by the ethertype to tell RXCSUM from RXCSUM_IPV6.
+ */
+static int
+ndis_rxcsum_enabled(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ether_header *eh;
+
+	if (m->m_len < ETHER_HDR_LEN)
+		return (0);
+	eh = mtod(m, struct ether_header *);
+	if (eh->ether_type == htons(ETHERTYPE_IPV6))
+		return ((ifp->if_capenable & IFCAP_RXCSUM_IPV6) != 0);
+	return ((ifp->if_capenable & IFCAP_RXCSUM) != 0);
 }
 
 /*
@@ -1320,12 +1754,22 @@ NdisMTransferDataComplete(struct ndis_miniport_block *block,
  * which indicates that it's ok for us to take posession of it. We then change
  * the status field to NDIS_STATUS_PENDING to tell the driver that we now own
  * the packet, and that we will return it at some point in the future via the
- * return packet handler.
+ * return packet handler. In this case ndis_ptom() builds an mbuf chain
+ * whose external storage points at the driver's buffers, and the packet
+ * goes back to the driver once the last mbuf referencing it is freed.
  *
  * If the driver hands us a packet with a status of NDIS_STATUS_RESOURCES,
  * this means the driver is running out of packet/buffer resources and wants
  * to maintain ownership of the packet. In this case, we have to copy the
  * packet data into local storage and let the driver keep the packet.
+ * We do the same if too many packets are already loaned to the stack,
+ * so that a slow consumer can't starve the driver of receive buffers.
+ *
+ * Frames no larger than the copy-break threshold are always copied into
+ * a single mbuf: for those, a copy is cheaper than building a chain with
+ * one external storage mbuf per MDL and returning the packet later.
+ * The path is picked before any mbuf is allocated, so a frame is either
+ * copied straight out of the MDLs or loaned, never both.
  */
 static void
 NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
@@ -1336,12 +1780,13 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 	uint32_t s;
 	struct ndis_tcpip_csum *csum;
 	struct ifnet *ifp;
-	struct mbuf *m0, *m;
+	struct mbuf *m0, *head = NULL, *tail = NULL;
 	int i;
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
 	ifp = sc->ndis_ifp;
+	ndis_intr_count(sc, pktcnt);
 
 	/*
 	 * There's a slim chance the driver may indicate some packets
@@ -1352,7 +1797,10 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 		for (i = 0; i < pktcnt; i++) {
 			p = packets[i];
 			if (p->oob.status == NDIS_STATUS_SUCCESS) {
-				p->refcnt++;
+				p->softc = sc;
+				p->refcnt = 1;
+				p->oob.status = NDIS_STATUS_PENDING;
+				atomic_add_int(&sc->ndis_rxloans, 1);
 				ndis_return_packet(NULL, block, p);
 			}
 		}
@@ -1363,50 +1811,121 @@ NdisMIndicateReceivePacket(struct ndis_miniport_block *block,
 		p = packets[i];
 		/* Stash the softc here so ptom can use it. */
 		p->softc = sc;
-		if (ndis_ptom(&m0, p)) {
-			device_printf(sc->ndis_dev, "ptom failed\n");
-			if (p->oob.status == NDIS_STATUS_SUCCESS)
-				ndis_return_packet(NULL, block, p);
-		} else {
-			m = m_dup(m0, M_NOWAIT);
-			if (p->oob.status == NDIS_STATUS_RESOURCES)
-				p->refcnt++;
-			else
+		if (ndis_ptom_copy(&m0, p, sc->ndis_rxcopybreak) == 0) {
+			/* Small frame, the driver gets the packet back now. */
+			counter_u64_add(sc->ndis_rx_copybreak, 1);
+		} else if (p->oob.status == NDIS_STATUS_SUCCESS &&
+		    ndis_rxloan_get(sc)) {
+			if (ndis_ptom(&m0, p)) {
+				device_printf(sc->ndis_dev, "ptom failed\n");
+				p->refcnt = 1;
 				p->oob.status = NDIS_STATUS_PENDING;
-			m_freem(m0);
-			if (m == NULL) {
-				if_inc_counter(ifp, IFCOUNTER_IERRORS, 1);
+				ndis_return_packet(NULL, block, p);
 				continue;
 			}
-			m0 = m;
-			m0->m_pkthdr.rcvif = ifp;
-
-			/* Deal with checksum offload. */
-			if (ifp->if_capenable & IFCAP_RXCSUM &&
-			    p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO] != NULL) {
-				s = (uintptr_t)
-				    p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
-				csum = (struct ndis_tcpip_csum *)&s;
-				if (csum->u.rxflags & NDIS_RXCSUM_IP_PASSED)
-					m0->m_pkthdr.csum_flags |=
-					    CSUM_IP_CHECKED|CSUM_IP_VALID;
-				if (csum->u.rxflags &
-				    (NDIS_RXCSUM_TCP_PASSED |
-				    NDIS_RXCSUM_UDP_PASSED)) {
-					m0->m_pkthdr.csum_flags |=
-					    CSUM_DATA_VALID|CSUM_PSEUDO_HDR;
-					m0->m_pkthdr.csum_data = 0xFFFF;
-				}
+			p->oob.status = NDIS_STATUS_PENDING;
+			counter_u64_add(sc->ndis_rx_loaned, 1);
+		} else if (ndis_ptom_copy(&m0, p, UINT32_MAX) == 0) {
+			/*
+			 * The driver wants the packet back, or too much
+			 * is loaned already: the frame is copied and the
+			 * driver reclaims the packet as soon as we return.
+			 */
+			counter_u64_add(sc->ndis_rx_copied, 1);
+		} else {
+			if_inc_counter(ifp, IFCOUNTER_IERRORS, 1);
+			continue;
+		}
+		m0->m_pkthdr.rcvif = ifp;
+
+		/* Deal with checksum offload. */
+		if (p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO] != NULL &&
+		    ndis_rxcsum_enabled(ifp, m0)) {
+			s = (uintptr_t)p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
+			csum = (struct ndis_tcpip_csum *)&s;
+			if (csum->u.rxflags & NDIS_RXCSUM_IP_PASSED)
+				m0->m_pkthdr.csum_flags |=
+				    CSUM_IP_CHECKED|CSUM_IP_VALID;
+			if (csum->u.rxflags &
+			    (NDIS_RXCSUM_TCP_PASSED | NDIS_RXCSUM_UDP_PASSED)) {
+				m0->m_pkthdr.csum_flags |=
+				    CSUM_DATA_VALID|CSUM_PSEUDO_HDR;
+				m0->m_pkthdr.csum_data = 0xFFFF;
 			}
+		}
+
+		ndis_rxflow(sc, m0);
+		NDIS_RXBATCH_ADD(head, tail, m0);
+	}
+
+	/* Hand the whole indication to the input task at once. */
+	if (head != NULL)
+		ndis_rxqueue_push(sc, head, tail);
+}
+
+/*
+ * Batches and RX queues are kept newest first; turn one into a list in
+ * arrival order.
+ */
+static struct mbuf *
+ndis_rxbatch_order(struct mbuf *m)
+{
+	struct mbuf *next, *list;
+
+	for (list = NULL; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = list;
+		list = m;
+	}
+	return (list);
+}
+
+/*
+ * Pass a list of Ethernet frames to the stack. With LRO enabled, TCP
+ * segments with a verified checksum are offered to the given LRO
+ * context first, which is flushed once the list has been handled.
+ * tcp_lro_rx() expects the headers in the first mbuf, but a loaned
+ * chain has one mbuf per MDL, so they are pulled up first.
+ */
+#define	NDIS_LRO_HDRLEN		(ETHER_HDR_LEN + 60 + 60)
+
+static void
+ndis_rxdeliver(struct ndis_softc *sc, struct mbuf *list, struct lro_ctrl *lro)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct mbuf *m, *next, *tail;
+	int len;
+
+	ndis_rxlat_record(sc, list, NDIS_RXLAT_TASK);
+	if (lro == NULL || lro->ifp == NULL ||
+	    (ifp->if_capenable & IFCAP_LRO) == 0) {
+		/* ether_input() takes a whole m_nextpkt list. */
+		(*ifp->if_input)(ifp, list);
+		return;
+	}
 
-			KeAcquireSpinLockAtDpcLevel(&sc->ndis_rxlock);
-			_IF_ENQUEUE(&sc->ndis_rxqueue, m0);
-			KeReleaseSpinLockFromDpcLevel(&sc->ndis_rxlock);
-			IoQueueWorkItem(sc->ndis_inputitem,
-			    (io_workitem_func)ndis_inputtask_wrap,
-			    CRITICAL, ifp);
+	m = list;
+	for (list = tail = NULL; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (m->m_pkthdr.csum_flags & CSUM_DATA_VALID) {
+			len = min(m->m_pkthdr.len, NDIS_LRO_HDRLEN);
+			if (m->m_len < len && (m = m_pullup(m, len)) == NULL) {
+				if_inc_counter(ifp, IFCOUNTER_IQDROPS, 1);
+				continue;
+			}
+			if (tcp_lro_rx(lro, m, 0) == 0)
+				continue;
 		}
+		if (tail == NULL)
+			list = m;
+		else
+			tail->m_nextpkt = m;
+		tail = m;
 	}
+	if (list != NULL)
+		(*ifp->if_input)(ifp, list);
+	tcp_lro_flush_all(lro);
 }
 
 /*
@@ -1422,80 +1941,581 @@ ndis_inputtask(struct device_object *dobj, void *arg)
 	struct ndis_softc *sc = ifp->if_softc;
 	struct ieee80211com *ic = ifp->if_l2com;
 	struct ieee80211vap *vap;
-	struct mbuf *m;
-	uint8_t irql;
+	struct mbuf *m, *next, *list;
 
 	vap = TAILQ_FIRST(&ic->ic_vaps);
 
-	KeAcquireSpinLock(&sc->ndis_rxlock, &irql);
-	for (;;) {
-		_IF_DEQUEUE(&sc->ndis_rxqueue, m);
-		if (m == NULL)
+	while ((m = (struct mbuf *)atomic_readandclear_ptr(
+	    (volatile uintptr_t *)&sc->ndis_rxhead)) != NULL) {
+		list = ndis_rxbatch_order(m);
+		if (!NDIS_80211(sc)) {
+			ndis_rxdeliver(sc, list, sc->ndis_lro);
+			continue;
+		}
+		for (m = list; m != NULL; m = next) {
+			next = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+			if (vap != NULL)
+				vap->iv_deliver_data(vap, vap->iv_bss, m);
+			else
+				(*ifp->if_input)(ifp, m);
+		}
+	}
+}
+
+/*
+ * Account for packets indicated or completed by the miniport, for the
+ * adaptive polling loop and ndis_poll(). Only indications made from
+ * within the HandleInterrupt() call in ndis_intr_run() count; sends
+ * completed from MiniportSend() or a miniport timer don't mean there's
+ * more work for HandleInterrupt().
+ */
+static void
+ndis_intr_count(struct ndis_softc *sc, u_int n)
+{
+
+	if (sc->ndis_intr_td == curthread)
+		sc->ndis_intr_work += n;
+}
+
+#ifdef DEVICE_POLLING
+/*
+ * DEVICE_POLLING entry point. The miniport has no way to say whether
+ * its hardware has anything pending, so just keep calling its
+ * HandleInterrupt() until it stops indicating or completing frames.
+ */
+static int
+ndis_poll(struct ifnet *ifp, enum poll_cmd cmd, int count)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	struct ndis_miniport_interrupt *intr;
+	uint8_t irql;
+	u_int total, work;
+
+	intr = sc->ndis_block->interrupt;
+	if (intr == NULL || !(ifp->if_drv_flags & IFF_DRV_RUNNING))
+		return (0);
+
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	total = 0;
+	do {
+		work = ndis_intr_run(sc, intr);
+		total += work;
+		counter_u64_add(sc->ndis_polls, 1);
+	} while (work != 0 && total < count);
+	KeLowerIrql(irql);
+	counter_u64_add(sc->ndis_poll_pkts, total);
+
+	return (total);
+}
+
+/*
+ * Switch between interrupts and DEVICE_POLLING. The miniport's
+ * interrupt mask is only ever touched under its serialization lock.
+ * When turning polling on, wait for an interrupt DPC that may already
+ * be past its ndis_polling check: it could otherwise re-enable
+ * interrupts behind our back. Later DPCs see ndis_polling and leave
+ * the miniport alone, and ndis_intr_run() keeps ndis_poll() from
+ * racing with one that's still running.
+ */
+static int
+ndis_setpolling(struct ndis_softc *sc, int on)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+	uint8_t irql = 0;
+	int error;
+
+	if (on) {
+		error = ether_poll_register(ndis_poll, ifp);
+		if (error)
+			return (error);
+	} else
+		ether_poll_deregister(ifp);
+	sc->ndis_polling = on;
+	atomic_thread_fence_seq_cst();
+
+	if (!NDIS_INITIALIZED(sc))
+		return (0);
+	if (on && sc->ndis_block->interrupt != NULL)
+		KeWaitForSingleObject(
+		    &sc->ndis_block->interrupt->dpc_completed_event,
+		    0, 0, FALSE, NULL);
+	if (NDIS_SERIALIZED(sc->ndis_block))
+		KeAcquireSpinLock(&sc->ndis_block->lock, &irql);
+	if (on)
+		ndis_disable_interrupts_nic(sc);
+	else
+		ndis_enable_interrupts_nic(sc);
+	if (NDIS_SERIALIZED(sc->ndis_block))
+		KeReleaseSpinLock(&sc->ndis_block->lock, irql);
+	return (0);
+}
+#endif
+
+/*
+ * Direct dispatch mode: rather than bouncing through the shared work
+ * item taskqueue, queue the frames straight to netisr from the DPC.
+ * netisr_queue() only takes the netisr queue lock, so this is safe
+ * with the emulated spinlocks held, and frames reach ether_nh_input()
+ * after one hand-off instead of two. 802.11 frames still need
+ * iv_deliver_data() and always take the input task path.
+ */
+static void
+ndis_rxdirect(struct ndis_softc *sc, struct mbuf *m)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct mbuf *next;
+
+	ndis_rxlat_record(sc, m, NDIS_RXLAT_DIRECT);
+	CURVNET_SET_QUIET(ifp->if_vnet);
+	for (m = ndis_rxbatch_order(m); m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		netisr_queue(NETISR_ETHER, m);
+	}
+	CURVNET_RESTORE();
+}
+
+/*
+ * rx_latency: stamp Ethernet frames as the DPC queues them and, when
+ * they are handed to the stack, count the time taken in a histogram
+ * per delivery mode. The stamp lives in PH_loc, which is ours until
+ * the frame is passed up, and is cleared again before that. With
+ * rx_direct the netisr thread still has to pick the frames up, which
+ * the input task path has already paid for with its own hand-off.
+ */
+static void
+ndis_rxlat_stamp(struct ndis_softc *sc, struct mbuf *m)
+{
+	sbintime_t now;
+
+	if (sc->ndis_rxlat == 0 || NDIS_80211(sc))
+		return;
+	now = sbinuptime();
+	for (; m != NULL; m = m->m_nextpkt)
+		m->m_pkthdr.PH_loc.sixtyfour[0] = now;
+}
+
+static void
+ndis_rxlat_record(struct ndis_softc *sc, struct mbuf *m, int mode)
+{
+	sbintime_t now, then;
+	uint64_t us;
+
+	if (sc->ndis_rxlat == 0)
+		return;
+	now = sbinuptime();
+	for (; m != NULL; m = m->m_nextpkt) {
+		then = m->m_pkthdr.PH_loc.sixtyfour[0];
+		if (then == 0)
+			continue;
+		m->m_pkthdr.PH_loc.sixtyfour[0] = 0;
+		us = sbttous(now - then);
+		counter_u64_add(sc->ndis_rxlat_hist[mode]
+		    [min(flsll(us), NDIS_RXLAT_BUCKETS - 1)], 1);
+	}
+}
+
+/* One line per power of two microseconds; the last one is open. */
+static int
+ndis_sysctl_rxlat(SYSCTL_HANDLER_ARGS)
+{
+	struct ndis_softc *sc = arg1;
+	counter_u64_t *hist = sc->ndis_rxlat_hist[arg2];
+	struct sbuf sb;
+	int error, i;
+
+	sbuf_new_for_sysctl(&sb, NULL, 256, req);
+	for (i = 0; i < NDIS_RXLAT_BUCKETS - 1; i++)
+		sbuf_printf(&sb, "\n <%uus\t%ju", 1 << i,
+		    (uintmax_t)counter_u64_fetch(hist[i]));
+	sbuf_printf(&sb, "\n>=%uus\t%ju", 1 << (NDIS_RXLAT_BUCKETS - 2),
+	    (uintmax_t)counter_u64_fetch(hist[i]));
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+
+	return (error);
+}
+
+/*
+ * Software RSS: hash the addresses of a received frame and, for TCP and
+ * UDP, the ports, so that every frame of a flow goes to the same input
+ * worker and keeps its order. The headers are copied out first since
+ * the first mbuf of a loaned chain may hold less than that, and the
+ * hash must not depend on how the miniport split the frame up.
+ */
+static uint32_t
+ndis_rxhash(struct mbuf *m)
+{
+	uint8_t buf[ETHER_HDR_LEN + 60 + 4];
+	struct ether_header *eh;
+	struct ip *ip;
+	struct ip6_hdr *ip6;
+	uint32_t hash;
+	int len, hlen;
+
+	len = min(m->m_pkthdr.len, sizeof(buf));
+	if (len < ETHER_HDR_LEN)
+		return (0);
+	m_copydata(m, 0, len, buf);
+	eh = (struct ether_header *)buf;
+	len -= ETHER_HDR_LEN;
+
+	switch (ntohs(eh->ether_type)) {
+	case ETHERTYPE_IP:
+		ip = (struct ip *)(eh + 1);
+		if (len < sizeof(struct ip))
+			break;
+		hash = jenkins_hash(&ip->ip_src, 2 * sizeof(struct in_addr),
+		    ip->ip_p);
+		hlen = ip->ip_hl << 2;
+		if ((ip->ip_off & htons(IP_MF | IP_OFFMASK)) == 0 &&
+		    (ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP) &&
+		    len >= hlen + 4)
+			hash = jenkins_hash((char *)ip + hlen, 4, hash);
+		return (hash);
+	case ETHERTYPE_IPV6:
+		ip6 = (struct ip6_hdr *)(eh + 1);
+		if (len < sizeof(struct ip6_hdr))
 			break;
-		KeReleaseSpinLock(&sc->ndis_rxlock, irql);
-		if (NDIS_80211(sc) && vap != NULL)
-			vap->iv_deliver_data(vap, vap->iv_bss, m);
+		hash = jenkins_hash(&ip6->ip6_src,
+		    2 * sizeof(struct in6_addr), ip6->ip6_nxt);
+		if ((ip6->ip6_nxt == IPPROTO_TCP ||
+		    ip6->ip6_nxt == IPPROTO_UDP) &&
+		    len >= sizeof(struct ip6_hdr) + 4)
+			hash = jenkins_hash(ip6 + 1, 4, hash);
+		return (hash);
+	}
+	return (jenkins_hash(eh, ETHER_HDR_LEN, 0));
+}
+
+/* Tag a received frame with its flow hash if it is to be spread. */
+static void
+ndis_rxflow(struct ndis_softc *sc, struct mbuf *m)
+{
+	if (sc->ndis_rxworker == NULL)
+		return;
+	m->m_pkthdr.flowid = ndis_rxhash(m);
+	M_HASHTYPE_SET(m, M_HASHTYPE_OPAQUE);
+}
+
+/*
+ * Start the input workers asked for by the rx_workers tunable, each
+ * bound to its own CPU. A single worker means the plain input task.
+ */
+static int
+ndis_rxworkers_init(struct ndis_softc *sc)
+{
+	struct ndis_rxworker *rw;
+	cpuset_t mask;
+	u_int cpu, i;
+
+	sc->ndis_nrxworkers = min(sc->ndis_nrxworkers,
+	    min(mp_ncpus, NDIS_RXWORKERS_MAX));
+	if (sc->ndis_nrxworkers < 2) {
+		sc->ndis_nrxworkers = 1;
+		return (0);
+	}
+
+	sc->ndis_rxworker = malloc(sizeof(struct ndis_rxworker) *
+	    sc->ndis_nrxworkers, M_NDIS_DEV, M_NOWAIT|M_ZERO);
+	if (sc->ndis_rxworker == NULL)
+		return (ENOMEM);
+
+	cpu = CPU_FIRST();
+	for (i = 0; i < sc->ndis_nrxworkers; i++) {
+		rw = &sc->ndis_rxworker[i];
+		rw->rw_sc = sc;
+		TASK_INIT(&rw->rw_task, 0, ndis_rxworker_task, rw);
+		rw->rw_tq = taskqueue_create("ndis_rx", M_NOWAIT,
+		    taskqueue_thread_enqueue, &rw->rw_tq);
+		if (rw->rw_tq == NULL)
+			return (ENOMEM);
+		CPU_SETOF(cpu, &mask);
+		taskqueue_start_threads_cpuset(&rw->rw_tq, 1, PI_NET, &mask,
+		    "%s rx%u", device_get_nameunit(sc->ndis_dev), i);
+		if (sc->ndis_ifp->if_capabilities & IFCAP_LRO &&
+		    tcp_lro_init(&rw->rw_lro) == 0)
+			rw->rw_lro.ifp = sc->ndis_ifp;
+		cpu = CPU_NEXT(cpu);
+	}
+	return (0);
+}
+
+static void
+ndis_rxworkers_free(struct ndis_softc *sc)
+{
+	struct ndis_rxworker *rw;
+	struct mbuf *m, *next;
+	u_int i;
+
+	if (sc->ndis_rxworker == NULL)
+		return;
+	for (i = 0; i < sc->ndis_nrxworkers; i++) {
+		rw = &sc->ndis_rxworker[i];
+		if (rw->rw_tq != NULL)
+			taskqueue_free(rw->rw_tq);
+		for (m = rw->rw_head; m != NULL; m = next) {
+			next = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+			m_freem(m);
+		}
+		if (rw->rw_lro.ifp != NULL)
+			tcp_lro_free(&rw->rw_lro);
+	}
+	free(sc->ndis_rxworker, M_NDIS_DEV);
+	sc->ndis_rxworker = NULL;
+}
+
+/*
+ * Split a batch by flow hash and push each part onto its worker's
+ * queue, kicking the worker on the empty to non-empty transition just
+ * like ndis_rxqueue_push() does for the input task. The batch is walked
+ * newest first, so each part stays in the same order.
+ */
+static void
+ndis_rxworkers_push(struct ndis_softc *sc, struct mbuf *m)
+{
+	struct mbuf *head[NDIS_RXWORKERS_MAX], *tail[NDIS_RXWORKERS_MAX];
+	struct mbuf *next, *old;
+	struct ndis_rxworker *rw;
+	u_int i;
+
+	for (i = 0; i < sc->ndis_nrxworkers; i++)
+		head[i] = NULL;
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		i = m->m_pkthdr.flowid % sc->ndis_nrxworkers;
+		if (head[i] == NULL)
+			head[i] = m;
 		else
-			(*ifp->if_input)(ifp, m);
-		KeAcquireSpinLock(&sc->ndis_rxlock, &irql);
+			tail[i]->m_nextpkt = m;
+		tail[i] = m;
+	}
+
+	for (i = 0; i < sc->ndis_nrxworkers; i++) {
+		if (head[i] == NULL)
+			continue;
+		rw = &sc->ndis_rxworker[i];
+		do {
+			old = rw->rw_head;
+			tail[i]->m_nextpkt = old;
+		} while (!atomic_cmpset_ptr((volatile uintptr_t *)&rw->rw_head,
+		    (uintptr_t)old, (uintptr_t)head[i]));
+		if (old == NULL)
+			taskqueue_enqueue(rw->rw_tq, &rw->rw_task);
 	}
-	KeReleaseSpinLock(&sc->ndis_rxlock, irql);
 }
 
+/*
+ * Input worker task. Frames queued while the interface is going down
+ * are dropped rather than handed to an interface that may be detached
+ * by now.
+ */
+static void
+ndis_rxworker_task(void *arg, int pending)
+{
+	struct ndis_rxworker *rw = arg;
+	struct ndis_softc *sc = rw->rw_sc;
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct mbuf *m, *next;
+
+	while ((m = (struct mbuf *)atomic_readandclear_ptr(
+	    (volatile uintptr_t *)&rw->rw_head)) != NULL) {
+		m = ndis_rxbatch_order(m);
+		if ((ifp->if_drv_flags & IFF_DRV_RUNNING) == 0) {
+			for (; m != NULL; m = next) {
+				next = m->m_nextpkt;
+				m->m_nextpkt = NULL;
+				m_freem(m);
+			}
+			continue;
+		}
+		ndis_rxdeliver(sc, m, &rw->rw_lro);
+	}
+}
+
+/*
+ * The RX queue is a multi-producer, single-consumer list of mbufs linked
+ * through m_nextpkt, newest packet first. Producers build a batch with
+ * NDIS_RXBATCH_ADD() and push it with a single compare-and-swap; the
+ * input task takes the whole list with one atomic swap. The work item
+ * only needs queueing when the list goes from empty to non-empty, as
+ * otherwise the input task has yet to pick up what's already there.
+ */
+static void
+ndis_rxqueue_push(struct ndis_softc *sc, struct mbuf *head, struct mbuf *tail)
+{
+	struct mbuf *old;
+
+	ndis_rxlat_stamp(sc, head);
+	if (sc->ndis_rxdirect && !NDIS_80211(sc) &&
+	    (sc->ndis_ifp->if_capenable & IFCAP_LRO) == 0) {
+		ndis_rxdirect(sc, head);
+		return;
+	}
+	if (sc->ndis_rxworker != NULL) {
+		ndis_rxworkers_push(sc, head);
+		return;
+	}
+
+	do {
+		old = sc->ndis_rxhead;
+		tail->m_nextpkt = old;
+	} while (!atomic_cmpset_ptr((volatile uintptr_t *)&sc->ndis_rxhead,
+	    (uintptr_t)old, (uintptr_t)head));
+
+	if (old == NULL)
+		IoQueueWorkItem(sc->ndis_inputitem,
+		    (io_workitem_func)ndis_inputtask_wrap, CRITICAL,
+		    sc->ndis_ifp);
+}
+
+/*
+ * Completed packets are only queued here; ndis_txeof_reap() does the
+ * actual cleanup in bulk from the start task. This keeps the work done
+ * in the miniport's context to a couple of atomic operations, which
+ * matters for deserialized drivers completing many packets per DPC.
+ */
 static void
 NdisMSendComplete(struct ndis_miniport_block *block, struct ndis_packet *packet,
     int32_t status)
 {
 	struct ndis_softc *sc;
-	struct ifnet *ifp;
-	int idx;
-	struct mbuf *m;
+	struct list_entry *old;
 
 	sc = device_get_softc(block->physdeviceobj->devext);
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
-	ifp = sc->ndis_ifp;
 
-	m = packet->m0;
-	idx = packet->txidx;
-	if (sc->ndis_sc)
-		bus_dmamap_unload(sc->ndis_ttag, sc->ndis_tmaps[idx]);
+	/*
+	 * If ndis_start() is still walking the batch this packet was
+	 * sent in, make sure it doesn't look at it again.
+	 */
+	atomic_cmpset_ptr((volatile uintptr_t *)
+	    &sc->ndis_txstage[packet->txstage], (uintptr_t)packet, 0);
+
+	packet->oob.status = status;
+	ndis_intr_count(sc, 1);
+	do {
+		old = sc->ndis_txdone;
+		packet->list.nle_flink = old;
+	} while (!atomic_cmpset_ptr((volatile uintptr_t *)&sc->ndis_txdone,
+	    (uintptr_t)old, (uintptr_t)&packet->list));
+
+	/* Only the first completion of a batch needs to kick the reaper. */
+	if (old == NULL)
+		IoQueueWorkItem(sc->ndis_startitem,
+		    (io_workitem_func)ndis_starttask_wrap, CRITICAL,
+		    sc->ndis_ifp);
+}
 
-	ndis_free_packet(packet);
-	m_freem(m);
+/*
+ * Reap completed TX packets: unload their DMA maps, free the packets
+ * and mbufs, and release their ring slots. Counters and watchdog state
+ * are updated once for the whole batch.
+ */
+static void
+ndis_txeof_reap(struct ndis_softc *sc)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct ndis_packet *p;
+	struct list_entry *l, *next;
+	struct mbuf *m, *mfree = NULL;
+	uint64_t tsobytes = 0;
+	u_int ok = 0, err = 0, tso = 0;
+	int idx;
 
-	NDIS_LOCK(sc);
-	sc->ndis_txarray[idx] = NULL;
-	sc->ndis_txpending++;
+	l = (struct list_entry *)atomic_readandclear_ptr(
+	    (volatile uintptr_t *)&sc->ndis_txdone);
+	if (l == NULL)
+		return;
 
-	if (status == NDIS_STATUS_SUCCESS)
-		if_inc_counter(ifp, IFCOUNTER_OPACKETS, 1);
-	else
-		if_inc_counter(ifp, IFCOUNTER_OERRORS, 1);
+	for (; l != NULL; l = next) {
+		next = l->nle_flink;
+		p = CONTAINING_RECORD(l, struct ndis_packet, list);
+		idx = p->txidx;
+		if (p->oob.status == NDIS_STATUS_SUCCESS)
+			ok++;
+		else
+			err++;
+		if (sc->ndis_sc && sc->ndis_txslots[idx].ts_bounced)
+			bus_dmamap_sync(sc->ndis_bouncetag,
+			    sc->ndis_txslots[idx].ts_bouncemap,
+			    BUS_DMASYNC_POSTWRITE);
+		else if (sc->ndis_sc)
+			bus_dmamap_unload(sc->ndis_ttag, sc->ndis_tmaps[idx]);
+		m = p->m0;
+		m->m_nextpkt = mfree;
+		mfree = m;
+
+		/*
+		 * On completion of a large send, the miniport leaves the
+		 * number of TCP payload bytes it sent in place of the MSS.
+		 */
+		if (m->m_pkthdr.csum_flags & CSUM_TSO) {
+			tso++;
+			tsobytes += (uintptr_t)
+			    p->ext.info[TCP_LARGE_SEND_PACKET_INFO];
+		}
+		ndis_mtop_release(p, sc->ndis_txslots[idx].ts_mdl,
+		    NDIS_TXSLOT_MDLS);
+
+		/*
+		 * Release the ring slot. ndis_start() only reuses a slot
+		 * once it reads back NULL.
+		 */
+		atomic_store_rel_ptr((volatile uintptr_t *)
+		    &sc->ndis_txarray[idx], 0);
+	}
+
+	if (ok)
+		if_inc_counter(ifp, IFCOUNTER_OPACKETS, ok);
+	if (err)
+		if_inc_counter(ifp, IFCOUNTER_OERRORS, err);
+	if (tso) {
+		counter_u64_add(sc->ndis_tx_tso, tso);
+		counter_u64_add(sc->ndis_tx_tsobytes, tsobytes);
+	}
 
 	/*
 	 * Stop watchdog if there are no pending packets or restart timer if
-	 * there are.
+	 * there are. ndis_start() arms it under the lock too.
 	 */
+	atomic_add_int(&sc->ndis_txpending, ok + err);
+	NDIS_LOCK(sc);
 	if (sc->ndis_txpending == sc->ndis_maxpkts)
 		sc->ndis_tx_timer = 0;
 	else
 		sc->ndis_tx_timer = NDIS_PACKET_TX_TIMEOUT;
+	NDIS_UNLOCK(sc);
 
-	/*
-	 * Drop/set "tx hardware queue is full" flag if ndis_txarray can/can't
-	 * fit more packets.
-	 */
-	if (ifp->if_drv_flags & IFF_DRV_OACTIVE &&
-	    !sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)])
-		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
-	if (!ifp->if_drv_flags & IFF_DRV_OACTIVE &&
-	    sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)])
-		ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+	for (m = mfree; m != NULL; m = mfree) {
+		mfree = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		m_freem(m);
+	}
+}
 
-	NDIS_UNLOCK(sc);
+/*
+ * Copying a small frame, or one scattered over many mbufs, into the
+ * slot's bounce buffer is cheaper than loading a DMA map for it and
+ * hands the miniport a single SG element.
+ */
+static int
+ndis_txbounce_want(struct ndis_softc *sc, struct mbuf *m0)
+{
+	struct mbuf *m;
+	u_int frags = 0;
 
-	IoQueueWorkItem(sc->ndis_startitem,
-	    (io_workitem_func)ndis_starttask_wrap, CRITICAL, ifp);
+	if (m0->m_pkthdr.len > NDIS_TXBOUNCE_SIZE)
+		return (0);
+	if (m0->m_pkthdr.len <= sc->ndis_txcopy_len)
+		return (1);
+	for (m = m0; m != NULL; m = m->m_next)
+		if (m->m_len != 0)
+			frags++;
+	return (frags > sc->ndis_txcopy_frags);
 }
 
 static void
@@ -1623,6 +2643,7 @@ ndis_ticktask(struct device_object *d, void *arg)
 	struct ndis_softc *sc = arg;
 
 	KASSERT(NDIS_INITIALIZED(sc), ("not initialized"));
+	ndis_return_flush(sc->ndis_block);
 	if (ndis_check_for_hang_nic(sc))
 		ndis_reset_nic(sc);
 }
@@ -1679,8 +2700,12 @@ ndis_starttask(struct device_object *d, void *arg)
 {
 	struct ifnet *ifp = arg;
 
-	if (!IFQ_DRV_IS_EMPTY(&ifp->if_snd))
-		ndis_start(ifp);
+	/*
+	 * Reap completions, then let ndis_start() refill the ring and
+	 * update IFF_DRV_OACTIVE, even if there's nothing to send.
+	 */
+	ndis_txeof_reap(ifp->if_softc);
+	ndis_start(ifp);
 }
 
 /*
@@ -1690,6 +2715,13 @@ ndis_starttask(struct device_object *d, void *arg)
  * limit). Unfortunately, rather that accepting them in the form of a linked
  * list, they expect a contiguous array of pointers to packets.
  *
+ * Packets in flight are tracked in the ndis_txarray ring, while each
+ * batch is collected in the separate ndis_txstage array, so a batch can
+ * cross the end of the ring and always be up to maxpkts packets long.
+ * Since the staging array is shared, only one thread feeds the miniport
+ * at a time; anyone else coming in meanwhile just asks it to go around
+ * once more.
+ *
  * For those drivers which use the NDIS scatter/gather DMA mechanism,
  * we need to perform busdma work here. Those that use map registers
  * will do the mapping themselves on a buffer by buffer basis.
@@ -1699,127 +2731,272 @@ ndis_start(struct ifnet *ifp)
 {
 	struct ndis_softc *sc = ifp->if_softc;
 	struct mbuf *m = NULL;
-	struct ndis_packet **p0 = NULL, *p = NULL;
+	struct buf_ring *br;
+	struct ndis_packet *p = NULL;
+	struct ndis_txslot *ts;
 	struct ndis_tcpip_csum *csum;
-	uint32_t pcnt = 0;
-	int32_t status;
+	uint32_t i, pcnt;
 
-	if (ifp->if_drv_flags & IFF_DRV_OACTIVE)
+	NDIS_LOCK(sc);
+	if (sc->ndis_txbusy) {
+		sc->ndis_txagain = 1;
+		NDIS_UNLOCK(sc);
 		return;
+	}
+	sc->ndis_txbusy = 1;
 
-	NDIS_LOCK(sc);
-	p0 = &sc->ndis_txarray[sc->ndis_txidx];
+	for (;;) {
+		sc->ndis_txagain = 0;
+		ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 
-	while (sc->ndis_txpending) {
-		/*
-		 * Don't reuse txarray element which points to the packet
-		 * which is not yet processed by miniport driver. Set
-		 * "tx queue is full" flag.
-		 */
-		if (sc->ndis_txarray[NDIS_NEXT_TXIDX(sc)]) {
-			ifp->if_drv_flags |= IFF_DRV_OACTIVE;
-			break;
-		}
+		for (pcnt = 0; pcnt < sc->ndis_maxpkts; pcnt++) {
+			/*
+			 * Don't reuse a ring slot which points to a packet
+			 * not yet completed by the miniport driver. Set
+			 * "tx queue is full" flag.
+			 */
+			if (atomic_load_acq_ptr((volatile uintptr_t *)
+			    &sc->ndis_txarray[sc->ndis_txidx]) != 0) {
+				ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+				break;
+			}
 
-		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
-		if (m == NULL)
-			break;
+			m = ndis_txpeek(sc, &br);
+			if (m == NULL)
+				break;
 
-		NdisAllocatePacket(&status,
-		    &sc->ndis_txarray[sc->ndis_txidx], sc->ndis_txpool);
-		if (status != NDIS_STATUS_SUCCESS)
-			break;
+			/*
+			 * Recycle the slot's packet and MDLs, falling back
+			 * to allocated MDLs for long chains.
+			 */
+			ts = &sc->ndis_txslots[sc->ndis_txidx];
+			p = ts->ts_packet;
+			ts->ts_bounced = sc->ndis_sc && ts->ts_bounce != NULL &&
+			    ndis_txbounce_want(sc, m);
+			if (ts->ts_bounced) {
+				m_copydata(m, 0, m->m_pkthdr.len,
+				    ts->ts_bounce);
+				ndis_buftop_reuse(p, ts->ts_bounce,
+				    m->m_pkthdr.len, ts->ts_mdl);
+			} else if (ndis_mtop_reuse(m, p, ts->ts_mdl,
+			    NDIS_TXSLOT_MDLS)) {
+				if (br != NULL)
+					drbr_putback(ifp, br, m);
+				else
+					IFQ_DRV_PREPEND(&ifp->if_snd, m);
+				break;
+			}
+			if (br != NULL)
+				drbr_advance(ifp, br);
+
+			/*
+			 * Save pointer to original mbuf so we can free it
+			 * later.
+			 */
+			p->txstage = pcnt;
+			p->m0 = m;
+			p->oob.status = NDIS_STATUS_PENDING;
+
+			/*
+			 * Do scatter/gather processing, if driver requested it.
+			 * Bounced frames already sit in pre-mapped memory.
+			 */
+			if (sc->ndis_sc && ts->ts_bounced) {
+				bus_dmamap_sync(sc->ndis_bouncetag,
+				    ts->ts_bouncemap, BUS_DMASYNC_PREWRITE);
+				p->sclist.frags = 1;
+				p->sclist.elements[0].addr =
+				    ts->ts_bounce_paddr;
+				p->sclist.elements[0].len = m->m_pkthdr.len;
+				p->ext.info[SCATTER_GATHER_LIST_PACKET_INFO] =
+				    &p->sclist;
+				counter_u64_add(sc->ndis_tx_copied, 1);
+			} else if (sc->ndis_sc) {
+				bus_dmamap_load_mbuf(sc->ndis_ttag,
+				    sc->ndis_tmaps[sc->ndis_txidx], m,
+				    ndis_map_sclist, &p->sclist, BUS_DMA_NOWAIT);
+				bus_dmamap_sync(sc->ndis_ttag,
+				    sc->ndis_tmaps[sc->ndis_txidx],
+				    BUS_DMASYNC_PREREAD);
+				p->ext.info[SCATTER_GATHER_LIST_PACKET_INFO] =
+				    &p->sclist;
+				counter_u64_add(sc->ndis_tx_mapped, 1);
+			}
 
-		if (ndis_mtop(m, &sc->ndis_txarray[sc->ndis_txidx])) {
-			IFQ_DRV_PREPEND(&ifp->if_snd, m);
-			NDIS_UNLOCK(sc);
-			return;
+			/*
+			 * Handle large send and checksum offload. With large
+			 * send the miniport does all checksums of the
+			 * segments by itself.
+			 */
+			if (m->m_pkthdr.csum_flags & CSUM_TSO) {
+				p->ext.info[TCP_LARGE_SEND_PACKET_INFO] =
+				    (void *)(uintptr_t)m->m_pkthdr.tso_segsz;
+			} else if (ifp->if_capenable & IFCAP_TXCSUM_IPV6 &&
+			    m->m_pkthdr.csum_flags &
+			    (CSUM_TCP_IPV6 | CSUM_UDP_IPV6)) {
+				csum = (struct ndis_tcpip_csum *)
+					&p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
+				csum->u.txflags = NDIS_TXCSUM_DO_IPV6;
+				if (m->m_pkthdr.csum_flags & CSUM_TCP_IPV6)
+					csum->u.txflags |= NDIS_TXCSUM_DO_TCP;
+				if (m->m_pkthdr.csum_flags & CSUM_UDP_IPV6)
+					csum->u.txflags |= NDIS_TXCSUM_DO_UDP;
+				p->private.flags = NDIS_PROTOCOL_ID_TCP_IP;
+			} else if (ifp->if_capenable & IFCAP_TXCSUM &&
+			    m->m_pkthdr.csum_flags) {
+				csum = (struct ndis_tcpip_csum *)
+					&p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
+				csum->u.txflags = NDIS_TXCSUM_DO_IPV4;
+				if (m->m_pkthdr.csum_flags & CSUM_IP)
+					csum->u.txflags |= NDIS_TXCSUM_DO_IP;
+				if (m->m_pkthdr.csum_flags & CSUM_TCP)
+					csum->u.txflags |= NDIS_TXCSUM_DO_TCP;
+				if (m->m_pkthdr.csum_flags & CSUM_UDP)
+					csum->u.txflags |= NDIS_TXCSUM_DO_UDP;
+				p->private.flags = NDIS_PROTOCOL_ID_TCP_IP;
+			}
+
+			sc->ndis_txarray[sc->ndis_txidx] = p;
+			sc->ndis_txstage[pcnt] = p;
+			sc->ndis_txidx = NDIS_NEXT_TXIDX(sc);
+			atomic_subtract_int(&sc->ndis_txpending, 1);
+
+			/*
+			 * If there's a BPF listener, bounce a copy of this
+			 * frame to him.
+			 */
+			if (!NDIS_80211(sc))
+				BPF_MTAP(ifp, m);
 		}
 
-		/*
-		 * Save pointer to original mbuf so we can free it later.
-		 */
-		p = sc->ndis_txarray[sc->ndis_txidx];
-		p->txidx = sc->ndis_txidx;
-		p->m0 = m;
-		p->oob.status = NDIS_STATUS_PENDING;
+		if (pcnt == 0)
+			break;
 
 		/*
-		 * Do scatter/gather processing, if driver requested it.
+		 * Activate a watchdog timer if it was stopped.
 		 */
-		if (sc->ndis_sc) {
-			bus_dmamap_load_mbuf(sc->ndis_ttag,
-			    sc->ndis_tmaps[sc->ndis_txidx], m,
-			    ndis_map_sclist, &p->sclist, BUS_DMA_NOWAIT);
-			bus_dmamap_sync(sc->ndis_ttag,
-			    sc->ndis_tmaps[sc->ndis_txidx],
-			    BUS_DMASYNC_PREREAD);
-			p->ext.info[SCATTER_GATHER_LIST_PACKET_INFO] = &p->sclist;
-		}
-
-		/* Handle checksum offload. */
-		if (ifp->if_capenable & IFCAP_TXCSUM &&
-		    m->m_pkthdr.csum_flags) {
-			csum = (struct ndis_tcpip_csum *)
-				&p->ext.info[TCP_IP_CHECKSUM_PACKET_INFO];
-			csum->u.txflags = NDIS_TXCSUM_DO_IPV4;
-			if (m->m_pkthdr.csum_flags & CSUM_IP)
-				csum->u.txflags |= NDIS_TXCSUM_DO_IP;
-			if (m->m_pkthdr.csum_flags & CSUM_TCP)
-				csum->u.txflags |= NDIS_TXCSUM_DO_TCP;
-			if (m->m_pkthdr.csum_flags & CSUM_UDP)
-				csum->u.txflags |= NDIS_TXCSUM_DO_UDP;
-			p->private.flags = NDIS_PROTOCOL_ID_TCP_IP;
-		}
-
-		sc->ndis_txidx = NDIS_NEXT_TXIDX(sc);
-		sc->ndis_txpending--;
-
-		pcnt++;
+		if (sc->ndis_tx_timer == 0)
+			sc->ndis_tx_timer = NDIS_PACKET_TX_TIMEOUT;
 
-		/*
-		 * If there's a BPF listener, bounce a copy of this frame
-		 * to him.
-		 */
-		if (!NDIS_80211(sc))
-			BPF_MTAP(ifp, m);
+		NDIS_UNLOCK(sc);
 
 		/*
-		 * The array that p0 points to must appear contiguous,
-		 * so we must not wrap past the end of sc->ndis_txarray[].
-		 * If it looks like we're about to wrap, break out here
-		 * so the this batch of packets can be transmitted, then
-		 * wait for txeof to ask us to send the rest.
+		 * According to NDIS documentation, if a driver exports
+		 * a MiniportSendPackets() routine, we prefer that over
+		 * a MiniportSend() routine (which sends just a single packet).
+		 * Entries of packets that complete before we get to them
+		 * are cleared by NdisMSendComplete().
 		 */
-		if (sc->ndis_txidx == 0)
+		if (sc->ndis_chars->send_packets_func != NULL)
+			ndis_send_packets(sc, sc->ndis_txstage, pcnt);
+		else {
+			for (i = 0; i < pcnt; i++) {
+				p = sc->ndis_txstage[i];
+				if (p != NULL)
+					ndis_send_packet(sc, p);
+			}
+		}
+
+		NDIS_LOCK(sc);
+		if (!sc->ndis_txagain && pcnt < sc->ndis_maxpkts)
 			break;
 	}
 
-	if (pcnt == 0) {
-		NDIS_UNLOCK(sc);
-		return;
-	}
+	sc->ndis_txbusy = 0;
+	NDIS_UNLOCK(sc);
+}
 
-	if (sc->ndis_txpending == 0)
-		ifp->if_drv_flags |= IFF_DRV_OACTIVE;
+/*
+ * Pick the next frame to send, either from the ifnet send queue or,
+ * with if_transmit, from the per-CPU rings served round robin. A frame
+ * taken from a ring stays there until drbr_advance() is called.
+ */
+static struct mbuf *
+ndis_txpeek(struct ndis_softc *sc, struct buf_ring **brp)
+{
+	struct ifnet *ifp = sc->ndis_ifp;
+	struct mbuf *m;
+	u_int i, idx;
 
-	/*
-	 * Activate a watchdog timer if it was stopped.
-	 */
-	if (sc->ndis_tx_timer == 0)
-		sc->ndis_tx_timer = NDIS_PACKET_TX_TIMEOUT;
+	NDIS_LOCK_ASSERT(sc, MA_OWNED);
+	*brp = NULL;
+	if (sc->ndis_txbr == NULL) {
+		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
+		return (m);
+	}
+	for (i = 0; i <= mp_maxid; i++) {
+		idx = sc->ndis_txbrnext;
+		sc->ndis_txbrnext = idx == mp_maxid ? 0 : idx + 1;
+		m = drbr_peek(ifp, sc->ndis_txbr[idx]);
+		if (m != NULL) {
+			*brp = sc->ndis_txbr[idx];
+			return (m);
+		}
+	}
+	return (NULL);
+}
 
-	NDIS_UNLOCK(sc);
+/*
+ * if_transmit routine for deserialized miniports. Senders only stage
+ * the frame on a buf_ring without taking any lock. The first one to
+ * raise ndis_txdrainreq drains the rings through ndis_start(), going
+ * around again for as long as others have staged frames meanwhile,
+ * unless the TX ring is full.
+ */
+static int
+ndis_transmit(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	struct buf_ring *br;
+	u_int req;
+	int error;
 
-	/*
-	 * According to NDIS documentation, if a driver exports
-	 * a MiniportSendPackets() routine, we prefer that over
-	 * a MiniportSend() routine (which sends just a single packet).
-	 */
-	if (sc->ndis_chars->send_packets_func != NULL)
-		ndis_send_packets(sc, p0, pcnt);
+	if (M_HASHTYPE_GET(m) != M_HASHTYPE_NONE)
+		br = sc->ndis_txbr[m->m_pkthdr.flowid % (mp_maxid + 1)];
 	else
-		ndis_send_packet(sc, p);
+		br = sc->ndis_txbr[curcpu];
+	error = drbr_enqueue(ifp, br, m);
+	if (error) {
+		if_inc_counter(ifp, IFCOUNTER_OQDROPS, 1);
+		return (error);
+	}
+
+	if (atomic_fetchadd_int(&sc->ndis_txdrainreq, 1) != 0)
+		return (0);
+	for (;;) {
+		req = sc->ndis_txdrainreq;
+		ndis_start(ifp);
+		if (ifp->if_drv_flags & IFF_DRV_OACTIVE) {
+			/*
+			 * The TX ring is full and only completions can make
+			 * room, after which ndis_starttask() drains again.
+			 * Step down instead of spinning until then, but go
+			 * on if a reap cleared OACTIVE before we let go.
+			 */
+			atomic_store_rel_int(&sc->ndis_txdrainreq, 0);
+			if (ifp->if_drv_flags & IFF_DRV_OACTIVE ||
+			    atomic_fetchadd_int(&sc->ndis_txdrainreq, 1) != 0)
+				return (0);
+			continue;
+		}
+		if (atomic_cmpset_int(&sc->ndis_txdrainreq, req, 0))
+			return (0);
+	}
+}
+
+static void
+ndis_qflush(struct ifnet *ifp)
+{
+	struct ndis_softc *sc = ifp->if_softc;
+	struct mbuf *m;
+	u_int i;
+
+	NDIS_LOCK(sc);
+	for (i = 0; i <= mp_maxid; i++)
+		while ((m = buf_ring_dequeue_sc(sc->ndis_txbr[i])) != NULL)
+			m_freem(m);
+	NDIS_UNLOCK(sc);
+	if_qflush(ifp);
 }
 
 static void
@@ -1840,9 +3017,6 @@ ndis_init(void *xsc)
 	ndis_set_task_offload(sc);
 
 	NDIS_LOCK(sc);
-	sc->ndis_txidx = 0;
-	sc->ndis_txpending = sc->ndis_maxpkts;
-
 	ifp->if_drv_flags |= IFF_DRV_RUNNING;
 	ifp->if_drv_flags &= ~IFF_DRV_OACTIVE;
 	sc->ndis_tx_timer = 0;
@@ -2274,11 +3448,30 @@ ndis_ioctl(struct ifnet *ifp, u_long command, caddr_t data)
 		error = ifmedia_ioctl(ifp, ifr, &sc->ifmedia, command);
 		break;
 	case SIOCSIFCAP:
-		ifp->if_capenable = ifr->ifr_reqcap;
+		/*
+		 * IFCAP_LRO takes effect with the next input batch, since
+		 * ndis_inputtask() flushes LRO state after every batch.
+		 */
+#ifdef DEVICE_POLLING
+		if ((ifr->ifr_reqcap ^ ifp->if_capenable) & IFCAP_POLLING) {
+			error = ndis_setpolling(sc,
+			    (ifr->ifr_reqcap & IFCAP_POLLING) != 0);
+			if (error)
+				break;
+		}
+#endif
+		ifp->if_capenable = ifr->ifr_reqcap & ifp->if_capabilities;
+		ifp->if_hwassist = 0;
 		if (ifp->if_capenable & IFCAP_TXCSUM)
-			ifp->if_hwassist = sc->ndis_hwassist;
+			ifp->if_hwassist |= sc->ndis_hwassist &
+			    (CSUM_IP | CSUM_TCP | CSUM_UDP);
 		else
-			ifp->if_hwassist = 0;
+			ifp->if_capenable &= ~IFCAP_TSO4;
+		if (ifp->if_capenable & IFCAP_TXCSUM_IPV6)
+			ifp->if_hwassist |= sc->ndis_hwassist &
+			    (CSUM_TCP_IPV6 | CSUM_UDP_IPV6);
+		if (ifp->if_capenable & IFCAP_TSO4)
+			ifp->if_hwassist |= CSUM_TSO;
 		error = ndis_set_task_offload(sc);
 		break;
 	default:
@@ -63,6 +63,13 @@ __FBSDID("$FreeBSD$");
 
 MODULE_DEPEND(ndis, pci, 1, 1, 1);
 
+/* Set these to fall back to MSI or legacy INTx for broken miniports. */
+static int ndis_msix_disable = 0;
+TUNABLE_INT("hw.ndis.msix_disable", &ndis_msix_disable);
+static int ndis_msi_disable = 0;
+TUNABLE_INT("hw.ndis.msi_disable", &ndis_msi_disable);
+
+static int	ndis_alloc_msi(device_t);
 static int	ndis_attach_pci(device_t);
 static int	ndis_devcompare_pci(enum ndis_bus_type,
 		    struct ndis_device_type *, device_t);
@@ -125,6 +132,58 @@ ndis_probe_pci(device_t dev)
 	return (windrv_create_pdo(drv, dev));
 }
 
+/*
+ * Back the miniport's interrupt with a single MSI-X or MSI message
+ * instead of the shared INTx line, if the device and the tunables
+ * allow it. The miniport only ever registers one interrupt, so one
+ * message is all we ask for. ndis_convert_res() then reports it as
+ * an exclusive latched interrupt.
+ */
+static int
+ndis_alloc_msi(device_t dev)
+{
+	struct ndis_softc *sc;
+	int count;
+
+	sc = device_get_softc(dev);
+	if (ndis_msi_disable)
+		return (ENXIO);
+
+	count = 1;
+	if (!ndis_msix_disable && pci_msix_count(dev) > 0 &&
+	    pci_alloc_msix(dev, &count) == 0) {
+		if (count == 1)
+			sc->ndis_msi = 2;
+		else
+			pci_release_msi(dev);
+	}
+	count = 1;
+	if (!sc->ndis_msi && pci_msi_count(dev) > 0 &&
+	    pci_alloc_msi(dev, &count) == 0) {
+		if (count == 1)
+			sc->ndis_msi = 1;
+		else
+			pci_release_msi(dev);
+	}
+	if (!sc->ndis_msi)
+		return (ENXIO);
+
+	sc->ndis_irq_rid = 1;
+	sc->ndis_irq = bus_alloc_resource_any(dev, SYS_RES_IRQ,
+	    &sc->ndis_irq_rid, RF_ACTIVE);
+	if (sc->ndis_irq == NULL) {
+		pci_release_msi(dev);
+		sc->ndis_msi = 0;
+		sc->ndis_irq_rid = 0;
+		return (ENXIO);
+	}
+	if (bootverbose)
+		device_printf(dev, "using %s\n",
+		    sc->ndis_msi == 2 ? "MSI-X" : "MSI");
+
+	return (0);
+}
+
 static int
 ndis_attach_pci(device_t dev)
 {
@@ -134,7 +193,7 @@ ndis_attach_pci(device_t dev)
 	struct resource_list_entry *rle;
 	struct drvdb_ent *db;
 	uint32_t devidx = 0, defidx = 0;
-	int error = 0, rid;
+	int error = 0, irqs = 0;
 
 	sc = device_get_softc(dev);
 	sc->ndis_dev = dev;
@@ -195,14 +254,9 @@ ndis_attach_pci(device_t dev)
 			}
 			break;
 		case SYS_RES_IRQ:
-			rid = rle->rid;
-			sc->ndis_irq = bus_alloc_resource_any(dev, SYS_RES_IRQ,
-			    &rid, RF_SHAREABLE | RF_ACTIVE);
-			if (sc->ndis_irq == NULL) {
-				device_printf(dev, "no irq\n");
-				error = ENXIO;
-				goto fail;
-			}
+			/* Allocated below, once we know if MSI works. */
+			if (irqs++ == 0)
+				sc->ndis_irq_rid = rle->rid;
 			break;
 		default:
 			break;
@@ -211,23 +265,32 @@ ndis_attach_pci(device_t dev)
 	}
 
 	/*
-	 * If the BIOS did not set up an interrupt for this device,
-	 * the resource traversal code above will fail to set up
-	 * an IRQ resource. This is usually a bad thing, so try to
-	 * force the allocation of an interrupt here. If one was
-	 * not assigned to us by the BIOS, bus_alloc_resource_any()
-	 * should route one for us.
+	 * Prefer a message signalled interrupt. MSI-X needs the BAR
+	 * holding its table, so this has to come after the loop above.
+	 * ndis_convert_res() only reports the IRQ we end up using.
 	 */
-	if (sc->ndis_irq == NULL) {
-		rid = 0;
+	if (ndis_alloc_msi(dev) == 0) {
+		if (irqs == 0)
+			sc->ndis_rescnt++;
+	} else {
+		/*
+		 * If the BIOS did not set up an interrupt for this
+		 * device, the resource list holds no IRQ resource. This
+		 * is usually a bad thing, so try to force the allocation
+		 * of an interrupt here. If one was not assigned to us by
+		 * the BIOS, bus_alloc_resource_any() should route one
+		 * for us.
+		 */
 		sc->ndis_irq = bus_alloc_resource_any(dev, SYS_RES_IRQ,
-		    &rid, RF_SHAREABLE | RF_ACTIVE);
+		    &sc->ndis_irq_rid, RF_SHAREABLE | RF_ACTIVE);
 		if (sc->ndis_irq == NULL) {
-			device_printf(dev, "couldn't route interrupt\n");
+			device_printf(dev, irqs ? "no irq\n" :
+			    "couldn't route interrupt\n");
 			error = ENXIO;
 			goto fail;
 		}
-		sc->ndis_rescnt++;
+		if (irqs == 0)
+			sc->ndis_rescnt++;
 	}
 
 	/*
@@ -69,10 +69,18 @@ TAILQ_HEAD(nch, ndis_cfglist);
 
 #define	NDIS_INITIALIZED(sc)	(sc->ndis_block->device_ctx != NULL)
 #define	NDIS_80211(sc)		\
-	sc->ndis_physical_medium == NDIS_PHYSICAL_MEDIUM_WIRELESS_LAN
+	((sc)->ndis_physical_medium == NDIS_PHYSICAL_MEDIUM_WIRELESS_LAN)
 
 #define	NDIS_NEXT_TXIDX(x)	((x)->ndis_txidx + 1) % (x)->ndis_maxpkts
 
+/* Prepend an mbuf to a newest-first RX batch, see ndis_rxqueue_push(). */
+#define	NDIS_RXBATCH_ADD(head, tail, m)	do {			\
+	(m)->m_nextpkt = (head);				\
+	(head) = (m);						\
+	if ((tail) == NULL)					\
+		(tail) = (m);					\
+} while (0)
+
 #define	NDIS_EVENTS	4
 #define	NDIS_EVTINC(x)	(x) = ((x) + 1) % NDIS_EVENTS
 
@@ -90,6 +98,13 @@ struct ndis_vap {
 #define	NDIS_VAP(vap)	((struct ndis_vap *)(vap))
 
 #define	NDIS_PACKET_TX_TIMEOUT			5
+#define	NDIS_RXLOANS_MAX			32
+#define	NDIS_RXLOANS_WAIT			5	/* seconds */
+#define	NDIS_RXCOPYBREAK			256
+#define	NDIS_RXWORKERS_MAX			16
+#define	NDIS_RXLAT_BUCKETS			16
+#define	NDIS_RXLAT_TASK				0
+#define	NDIS_RXLAT_DIRECT			1
 
 #define	NDISUSB_CONFIG_NO			0
 #define	NDISUSB_IFACE_INDEX			0
@@ -127,16 +142,54 @@ struct ndisusb_task {
 	struct list_entry	nt_tasklist;
 };
 
+/*
+ * Each TX ring slot owns an ndis_packet and a few MDLs, which are
+ * recycled for every frame sent through that slot.
+ */
+#define	NDIS_TXSLOT_MDLS	8
+
+/*
+ * With scatter/gather DMA, each slot also gets a bounce buffer of its
+ * own that is loaded once at ndis_init_dma() time. Small or badly
+ * fragmented frames are copied there and sent as a single MDL and SG
+ * element instead of being mapped. Each buffer has its own map so
+ * that only the slot in use is synced.
+ */
+#define	NDIS_TXBOUNCE_SIZE	MCLBYTES
+#define	NDIS_TXCOPY_LEN		256
+#define	NDIS_TXCOPY_FRAGS	4
+
+/*
+ * Deserialized miniports get if_transmit with a staging buf_ring per
+ * CPU, drained by whoever calls ndis_start().
+ */
+#define	NDIS_TXBR_SIZE		1024
+
+struct ndis_txslot {
+	struct ndis_packet	*ts_packet;
+	struct ndis_txmdl	ts_mdl[NDIS_TXSLOT_MDLS];
+	void			*ts_bounce;
+	bus_dmamap_t		ts_bouncemap;
+	uint64_t		ts_bounce_paddr;
+	uint8_t			ts_bounced;
+};
+
 struct ndis_softc {
 	struct ifnet			*ndis_ifp;
 	struct ifmedia			ifmedia;	/* media info */
 	u_long				ndis_hwassist;
 	uint32_t			ndis_v4tx;
 	uint32_t			ndis_v4rx;
+	uint32_t			ndis_v6tx;
+	uint32_t			ndis_v6rx;
+	struct ndis_task_tcp_largesend	ndis_lso;
 	bus_space_handle_t		ndis_bhandle;
 	bus_space_tag_t			ndis_btag;
 	void				*ndis_intrhand;
+	struct nt_intvec		*ndis_intrvec;
 	struct resource			*ndis_irq;
+	int				ndis_irq_rid;
+	int				ndis_msi;
 	struct resource			*ndis_res;
 	struct resource			*ndis_res_io;
 	int				ndis_io_rid;
@@ -150,15 +203,16 @@ struct ndis_softc {
 	struct resource_list		ndis_rl;
 	uint32_t			ndis_rescnt;
 	struct mtx			ndis_mtx;
+	uint8_t				ndis_reqbusy;	/* under ndis_mtx */
 	device_t			ndis_dev;
 	struct ndis_miniport_block	*ndis_block;
 	struct ndis_miniport_characteristics *ndis_chars;
 	struct callout			ndis_scan_callout;
 	struct callout			ndis_stat_callout;
 	uint32_t			ndis_maxpkts;
-	uint32_t			ndis_txidx;
-	uint32_t			ndis_txpending;
 	struct ndis_packet		**ndis_txarray;
+	struct ndis_packet		**ndis_txstage;
+	struct ndis_txslot		*ndis_txslots;
 	struct ndis_packet_pool		*ndis_txpool;
 	uint8_t				ndis_sc;
 	struct ndis_cfg			*ndis_regvals;
@@ -178,16 +232,66 @@ struct ndis_softc {
 	bus_dma_tag_t			ndis_ttag;
 	bus_dmamap_t			*ndis_mmaps;
 	bus_dmamap_t			*ndis_tmaps;
+	bus_dma_tag_t			ndis_bouncetag;
+	u_int				ndis_txcopy_len;
+	u_int				ndis_txcopy_frags;
+	counter_u64_t			ndis_tx_copied;
+	counter_u64_t			ndis_tx_mapped;
+	counter_u64_t			ndis_tx_tso;
+	counter_u64_t			ndis_tx_tsobytes;
 	uint32_t			ndis_mmapcnt;
 	struct ndis_evt			ndis_evt[NDIS_EVENTS];
 	uint32_t			ndis_evtpidx;
 	uint32_t			ndis_evtcidx;
-	struct ifqueue			ndis_rxqueue;
-	unsigned long			ndis_rxlock;
+	struct mbuf * volatile		ndis_rxhead;
+	struct lro_ctrl			*ndis_lro;
+	struct ndis_rxworker		*ndis_rxworker;
+	u_int				ndis_nrxworkers;
+	u_int				ndis_rxdirect;
+	u_int				ndis_rxlat;
+	counter_u64_t			ndis_rxlat_hist[2][NDIS_RXLAT_BUCKETS];
+	/*
+	 * Packets indicated or completed by the HandleInterrupt() call
+	 * that ndis_intr_td is running, under ndis_intr_runlock (or the
+	 * miniport lock, if it's serialized).
+	 */
+	unsigned long			ndis_intr_runlock;
+	struct thread * volatile	ndis_intr_td;
+	u_int				ndis_intr_work;
+	u_int				ndis_poll_budget;
+	uint8_t				ndis_polling;
+	counter_u64_t			ndis_intrs;
+	counter_u64_t			ndis_polls;
+	counter_u64_t			ndis_poll_pkts;
+	volatile u_int			ndis_rxloans;
+	u_int				ndis_rxloans_max;
+	volatile u_int			ndis_rxnoloan;
+	u_int				ndis_rxcopybreak;
+	counter_u64_t			ndis_rx_copybreak;
+	counter_u64_t			ndis_rx_copied;
+	counter_u64_t			ndis_rx_loaned;
+
+	/*
+	 * TX ring. The producer side is only touched by ndis_start()
+	 * with ndis_mtx held; completed packets are pushed onto the
+	 * ndis_txdone list by NdisMSendComplete() and their slots are
+	 * released by ndis_txeof_reap(), all without taking any lock.
+	 * With if_transmit, senders only stage frames on the per-CPU
+	 * ndis_txbr rings; ndis_txdrainreq elects one of them to run
+	 * ndis_start(). Keep the two sides on separate cache lines.
+	 */
+	uint32_t			ndis_txidx __aligned(CACHE_LINE_SIZE);
+	uint8_t				ndis_txbusy;
+	uint8_t				ndis_txagain;
+	struct buf_ring			**ndis_txbr;
+	u_int				ndis_txbrnext;
+	volatile u_int			ndis_txdrainreq;
+	volatile u_int			ndis_txpending __aligned(CACHE_LINE_SIZE);
+	struct list_entry * volatile	ndis_txdone;
+	uint8_t				ndis_tx_timer;
 
 	int			(*ndis_newstate)(struct ieee80211com *,
 				    enum ieee80211_state, int);
-	uint8_t				ndis_tx_timer;
 	uint32_t			ndis_hang_timer;
 
 	struct usb_device		*ndisusb_dev;